@@ -0,0 +1,433 @@
+/*
+libspindle benchmark suite, run with "make bench".
+
+Measures empty job dispatch throughput, dispatch-to-start latency,
+barrier round trips and the behaviour of a saturated pool, and prints
+one record per measurement as CSV (default) or JSON, so that the numbers
+of two builds can be compared.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <spindle.h>
+
+#define BENCH_MAX_PRODUCERS 64
+#define BENCH_SATURATION_QUEUE 1024
+
+typedef struct _bench_result_t {
+	const char *suite;
+	const char *scheduler;
+	int workers;
+	int producers;
+	int param;              /* fan-out for the barrier suite, queue size for saturation */
+	unsigned long jobs;
+	double usec;            /* wall time of the whole run */
+	double p50, p90, p99, p999, max; /* latency percentiles in usec, latency suite only */
+	unsigned long blocked;  /* dispatcher waits for a free slot */
+	unsigned long rejected; /* EAGAIN from spindle_try_dispatch() */
+} bench_result_t;
+
+typedef struct _bench_producer_t {
+	pthread_t thread;
+	spindle_t *pool;
+	spindle_barrier_t *barrier;
+	unsigned long jobs;
+	int try_dispatch;
+	unsigned long rejected;
+} bench_producer_t;
+
+static int bench_json = 0;
+static int bench_records = 0;
+static unsigned long bench_jobs = 200000;
+static int bench_max_workers = 0;
+static int bench_max_producers = 4;
+static const char *bench_suites = "throughput,latency,barrier,saturation";
+
+static inline unsigned long bench_now_nsec(void) /* {{{ */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+/* }}} */
+
+static void bench_empty_job(void *arg) /* {{{ */
+{
+}
+/* }}} */
+
+/* spins for about a microsecond, so that the workers can't keep up with the producers */
+static void bench_small_job(void *arg) /* {{{ */
+{
+	unsigned long until = bench_now_nsec() + 1000;
+
+	while (bench_now_nsec() < until);
+}
+/* }}} */
+
+/* the argument holds the dispatch time, the job replaces it with its latency */
+static void bench_latency_job(void *arg) /* {{{ */
+{
+	unsigned long *slot = (unsigned long *)arg;
+
+	*slot = bench_now_nsec() - *slot;
+}
+/* }}} */
+
+static void bench_print(const bench_result_t *r) /* {{{ */
+{
+	if (bench_json) {
+		printf("%s\n  {\"suite\": \"%s\", \"scheduler\": \"%s\", \"workers\": %d, \"producers\": %d, \"param\": %d, "
+				"\"jobs\": %lu, \"usec\": %.1f, \"jobs_per_sec\": %.0f, "
+				"\"p50_usec\": %.2f, \"p90_usec\": %.2f, \"p99_usec\": %.2f, \"p999_usec\": %.2f, \"max_usec\": %.2f, "
+				"\"blocked\": %lu, \"rejected\": %lu}",
+				bench_records ? "," : "[",
+				r->suite, r->scheduler, r->workers, r->producers, r->param,
+				r->jobs, r->usec, r->usec > 0 ? r->jobs * 1e6 / r->usec : 0.0,
+				r->p50, r->p90, r->p99, r->p999, r->max,
+				r->blocked, r->rejected);
+	} else {
+		if (bench_records == 0) {
+			printf("suite,scheduler,workers,producers,param,jobs,usec,jobs_per_sec,p50_usec,p90_usec,p99_usec,p999_usec,max_usec,blocked,rejected\n");
+		}
+		printf("%s,%s,%d,%d,%d,%lu,%.1f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%lu,%lu\n",
+				r->suite, r->scheduler, r->workers, r->producers, r->param,
+				r->jobs, r->usec, r->usec > 0 ? r->jobs * 1e6 / r->usec : 0.0,
+				r->p50, r->p90, r->p99, r->p999, r->max,
+				r->blocked, r->rejected);
+	}
+	fflush(stdout);
+	bench_records++;
+}
+/* }}} */
+
+static spindle_t *bench_pool(int scheduler, int workers, int max_queue_size) /* {{{ */
+{
+	spindle_attr_t attr;
+	spindle_t *pool;
+
+	spindle_attr_init(&attr);
+	attr.scheduler = scheduler;
+	pool = spindle_create_with_attr(workers, max_queue_size, &attr);
+	if (pool == NULL) {
+		fprintf(stderr, "spindle_bench: failed to create a pool of %d workers\n", workers);
+		exit(1);
+	}
+	return pool;
+}
+/* }}} */
+
+static void *bench_produce(void *arg) /* {{{ */
+{
+	bench_producer_t *p = (bench_producer_t *)arg;
+	void (*job)(void *) = p->try_dispatch ? bench_small_job : bench_empty_job;
+	unsigned long i;
+
+	for (i = 0; i < p->jobs; i++) {
+		if (!p->try_dispatch) {
+			spindle_dispatch(p->pool, p->barrier, job, NULL);
+		} else {
+			while (spindle_try_dispatch(p->pool, p->barrier, job, NULL) == EAGAIN) {
+				p->rejected++;
+			}
+		}
+	}
+	return NULL;
+}
+/* }}} */
+
+/* dispatches bench_jobs jobs from the given number of threads, returns the wall time in usec */
+static double bench_run_producers(spindle_t *pool, int producers, int try_dispatch, unsigned long *rejected) /* {{{ */
+{
+	bench_producer_t p[BENCH_MAX_PRODUCERS];
+	spindle_barrier_t *barrier = spindle_barrier_create();
+	unsigned long start;
+	double usec;
+	int i;
+
+	spindle_barrier_start(barrier);
+	start = bench_now_nsec();
+	for (i = 0; i < producers; i++) {
+		p[i].pool = pool;
+		p[i].barrier = barrier;
+		p[i].jobs = bench_jobs / producers;
+		p[i].try_dispatch = try_dispatch;
+		p[i].rejected = 0;
+		pthread_create(&p[i].thread, NULL, bench_produce, &p[i]);
+	}
+	for (i = 0; i < producers; i++) {
+		pthread_join(p[i].thread, NULL);
+		if (rejected) {
+			*rejected += p[i].rejected;
+		}
+	}
+	spindle_barrier_wait(barrier);
+	usec = (bench_now_nsec() - start) / 1e3;
+
+	spindle_barrier_destroy(barrier);
+	return usec;
+}
+/* }}} */
+
+static void bench_throughput(int scheduler, const char *name) /* {{{ */
+{
+	bench_result_t r;
+	spindle_t *pool;
+	int workers, producers;
+
+	for (workers = 1; workers <= bench_max_workers; workers *= 2) {
+		pool = bench_pool(scheduler, workers, 0);
+		for (producers = 1; producers <= bench_max_producers; producers *= 2) {
+			memset(&r, 0, sizeof(r));
+			r.suite = "throughput";
+			r.scheduler = name;
+			r.workers = workers;
+			r.producers = producers;
+			r.jobs = (bench_jobs / producers) * producers;
+			r.usec = bench_run_producers(pool, producers, 0, NULL);
+			bench_print(&r);
+		}
+		spindle_destroy(pool);
+	}
+}
+/* }}} */
+
+static int bench_compare(const void *a, const void *b) /* {{{ */
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+/* }}} */
+
+static double bench_percentile(const unsigned long *sorted, unsigned long n, double p) /* {{{ */
+{
+	unsigned long i = (unsigned long)(p * (n - 1));
+
+	return sorted[i] / 1e3;
+}
+/* }}} */
+
+/* param 0: one job at a time, the workers go back to sleep in between (wakeup latency);
+ * param 1: a stream of jobs, the workers are busy (queueing latency) */
+static void bench_latency(int scheduler, const char *name) /* {{{ */
+{
+	unsigned long n = bench_jobs / 10, i, start;
+	unsigned long *samples;
+	spindle_barrier_t *barrier;
+	bench_result_t r;
+	spindle_t *pool;
+	int workers, burst;
+
+	samples = malloc(n * sizeof(unsigned long));
+	if (samples == NULL) {
+		return;
+	}
+	barrier = spindle_barrier_create();
+
+	for (workers = 1; workers <= bench_max_workers; workers *= 2) {
+		pool = bench_pool(scheduler, workers, 0);
+		for (burst = 0; burst <= 1; burst++) {
+			start = bench_now_nsec();
+			spindle_barrier_start(barrier);
+			for (i = 0; i < n; i++) {
+				samples[i] = bench_now_nsec();
+				spindle_dispatch(pool, barrier, bench_latency_job, &samples[i]);
+				if (!burst) {
+					spindle_barrier_wait(barrier);
+					spindle_barrier_start(barrier);
+				}
+			}
+			spindle_barrier_wait(barrier);
+
+			memset(&r, 0, sizeof(r));
+			r.suite = "latency";
+			r.scheduler = name;
+			r.workers = workers;
+			r.producers = 1;
+			r.param = burst;
+			r.jobs = n;
+			r.usec = (bench_now_nsec() - start) / 1e3;
+			qsort(samples, n, sizeof(unsigned long), bench_compare);
+			r.p50 = bench_percentile(samples, n, 0.5);
+			r.p90 = bench_percentile(samples, n, 0.9);
+			r.p99 = bench_percentile(samples, n, 0.99);
+			r.p999 = bench_percentile(samples, n, 0.999);
+			r.max = samples[n - 1] / 1e3;
+			bench_print(&r);
+		}
+		spindle_destroy(pool);
+	}
+
+	spindle_barrier_destroy(barrier);
+	free(samples);
+}
+/* }}} */
+
+/* a round trip is: start the barrier, dispatch fan-out empty jobs, wait for them */
+static void bench_barrier(int scheduler, const char *name) /* {{{ */
+{
+	static const int fanouts[] = {1, 8, 64, 512, 4096};
+	spindle_barrier_t *barrier;
+	unsigned long start, rounds, i;
+	bench_result_t r;
+	spindle_t *pool;
+	int f, j;
+
+	barrier = spindle_barrier_create();
+	pool = bench_pool(scheduler, bench_max_workers, 0);
+
+	for (f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); f++) {
+		rounds = bench_jobs / fanouts[f] / 4 + 1;
+		start = bench_now_nsec();
+		for (i = 0; i < rounds; i++) {
+			spindle_barrier_start(barrier);
+			for (j = 0; j < fanouts[f]; j++) {
+				spindle_dispatch(pool, barrier, bench_empty_job, NULL);
+			}
+			spindle_barrier_wait(barrier);
+		}
+
+		memset(&r, 0, sizeof(r));
+		r.suite = "barrier";
+		r.scheduler = name;
+		r.workers = bench_max_workers;
+		r.producers = 1;
+		r.param = fanouts[f];
+		r.jobs = rounds;
+		r.usec = (bench_now_nsec() - start) / 1e3;
+		bench_print(&r);
+	}
+
+	spindle_destroy(pool);
+	spindle_barrier_destroy(barrier);
+}
+/* }}} */
+
+/* small jobs into a small queue from twice as many producers as workers: once blocking, once with try_dispatch */
+static void bench_saturation(int scheduler, const char *name) /* {{{ */
+{
+	spindle_stats_t *stats;
+	bench_result_t r;
+	spindle_t *pool;
+	int producers, try_dispatch;
+
+	stats = malloc(sizeof(spindle_stats_t));
+	if (stats == NULL) {
+		return;
+	}
+	producers = bench_max_workers * 2;
+	if (producers > BENCH_MAX_PRODUCERS) {
+		producers = BENCH_MAX_PRODUCERS;
+	}
+
+	for (try_dispatch = 0; try_dispatch <= 1; try_dispatch++) {
+		pool = bench_pool(scheduler, bench_max_workers, BENCH_SATURATION_QUEUE);
+
+		memset(&r, 0, sizeof(r));
+		r.suite = try_dispatch ? "saturation_try" : "saturation";
+		r.scheduler = name;
+		r.workers = bench_max_workers;
+		r.producers = producers;
+		r.param = BENCH_SATURATION_QUEUE;
+		r.jobs = (bench_jobs / producers) * producers;
+		r.usec = bench_run_producers(pool, producers, try_dispatch, &r.rejected);
+		spindle_stats_get(pool, stats);
+		r.blocked = stats->blocked;
+		bench_print(&r);
+
+		spindle_destroy(pool);
+	}
+	free(stats);
+}
+/* }}} */
+
+static void bench_usage(void) /* {{{ */
+{
+	fprintf(stderr,
+			"usage: spindle_bench [-j] [-n jobs] [-w workers] [-p producers] [-s suites]\n"
+			"  -j            JSON output instead of CSV\n"
+			"  -n jobs       jobs per measurement (default 200000)\n"
+			"  -w workers    most workers to try, in powers of two (default: number of CPUs)\n"
+			"  -p producers  most producer threads to try, in powers of two (default 4)\n"
+			"  -s suites     comma separated list of throughput,latency,barrier,saturation (default: all)\n"
+			"  -S scheduler  shared or stealing (default: both)\n");
+}
+/* }}} */
+
+int main(int argc, char **argv) /* {{{ */
+{
+	static const char *names[] = {"shared", "stealing"};
+	static const int schedulers[] = {SPINDLE_SCHED_SHARED, SPINDLE_SCHED_STEALING};
+	const char *only = NULL;
+	int c, s;
+
+	while ((c = getopt(argc, argv, "jn:w:p:s:S:h")) != -1) {
+		switch (c) {
+			case 'j':
+				bench_json = 1;
+				break;
+			case 'n':
+				bench_jobs = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				bench_max_workers = atoi(optarg);
+				break;
+			case 'p':
+				bench_max_producers = atoi(optarg);
+				break;
+			case 's':
+				bench_suites = optarg;
+				break;
+			case 'S':
+				only = optarg;
+				break;
+			default:
+				bench_usage();
+				return 1;
+		}
+	}
+
+	if (bench_max_workers <= 0) {
+		bench_max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (bench_max_workers > SPINDLE_MAX_IN_POOL) {
+		bench_max_workers = SPINDLE_MAX_IN_POOL;
+	}
+	if (bench_max_producers < 1 || bench_max_producers > BENCH_MAX_PRODUCERS) {
+		bench_max_producers = BENCH_MAX_PRODUCERS;
+	}
+	if (bench_jobs < 1000) {
+		bench_jobs = 1000;
+	}
+
+	for (s = 0; s < 2; s++) {
+		if (only && strcmp(only, names[s]) != 0) {
+			continue;
+		}
+		if (strstr(bench_suites, "throughput")) {
+			bench_throughput(schedulers[s], names[s]);
+		}
+		if (strstr(bench_suites, "latency")) {
+			bench_latency(schedulers[s], names[s]);
+		}
+		if (strstr(bench_suites, "barrier")) {
+			bench_barrier(schedulers[s], names[s]);
+		}
+		if (strstr(bench_suites, "saturation")) {
+			bench_saturation(schedulers[s], names[s]);
+		}
+	}
+
+	if (bench_json) {
+		printf("%s\n", bench_records ? "\n]" : "[]");
+	}
+	return 0;
+}
+/* }}} */
@@ -27,7 +27,7 @@ configure: aclocal.m4 configure.in ltmain
 	@echo rebuilding $@
 	$(AUTOCONF) $(SUPPRESS_WARNINGS)
 
-makefiles: configure Makefile.am src/Makefile.am
+makefiles: configure Makefile.am src/Makefile.am bench/Makefile.am tests/Makefile.am
 	@echo rebuilding Makefile.in files
 	$(AUTOMAKE) --add-missing --copy
 
@@ -18,469 +18,5099 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * but also contains a lot of modifications and improvements
  */
 
+#define _GNU_SOURCE
+
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include "spindle_config.h"
+
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_SYSCALL_H)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# define SPINDLE_HAVE_FUTEX 1
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+# define SPINDLE_HAVE_EVENTFD 1
+#endif
+
+#ifdef HAVE_UCONTEXT_H
+# include <ucontext.h>
+# include <sys/mman.h>
+# define SPINDLE_HAVE_FIBERS 1
+#endif
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(HAVE_SCHED_GETCPU)
+# define SPINDLE_HAVE_NUMA 1
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_PTHREAD_GETATTR_NP)
+# include <sys/mman.h>
+# define SPINDLE_HAVE_STACK_LOCK 1
+#endif
+
 #include "spindle.h"
 #include "spindle_internal.h"
 
 /* {{{ internal funcs and stuff */
 
-static inline spindle_queue_head_t *queue_create(int initial_cap, int max_cap) /* {{{ */
+/* sleeps while *addr == val, until woken up or until abstime (CLOCK_REALTIME, may be NULL);
+ * returns ETIMEDOUT on timeout, 0 otherwise, spurious wakeups are possible */
+#ifdef SPINDLE_HAVE_FUTEX
+static inline int spindle_futex_wait(volatile int *addr, int val, const struct timespec *abstime) /* {{{ */
+{
+	if (abstime == NULL) {
+		syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+		return 0;
+	}
+
+	if (-1 == syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, val, abstime, NULL, FUTEX_BITSET_MATCH_ANY) && errno == ETIMEDOUT) {
+		return ETIMEDOUT;
+	}
+	return 0;
+}
+/* }}} */
+
+static inline void spindle_futex_wake(volatile int *addr, int n) /* {{{ */
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+/* }}} */
+#else
+/* futex emulation: waiters sleep on a condition variable picked by the address */
+#define SPINDLE_FUTEX_BUCKETS 64
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} spindle_futex_buckets[SPINDLE_FUTEX_BUCKETS];
+static pthread_once_t spindle_futex_once = PTHREAD_ONCE_INIT;
+
+static void spindle_futex_init(void) /* {{{ */
 {
-	spindle_queue_head_t *job_queue = (spindle_queue_head_t *) malloc (sizeof(spindle_queue_head_t));
 	int i;
-	spindle_queue_node_t *temp;
 
-	if (job_queue == NULL) {
-		return NULL;
+	for (i = 0; i < SPINDLE_FUTEX_BUCKETS; i++) {
+		pthread_mutex_init(&spindle_futex_buckets[i].mutex, NULL);
+		pthread_cond_init(&spindle_futex_buckets[i].cond, NULL);
 	}
+}
+/* }}} */
 
-	if (initial_cap == 0) {
-		return NULL;
+static inline int spindle_futex_bucket(volatile int *addr) /* {{{ */
+{
+	pthread_once(&spindle_futex_once, spindle_futex_init);
+	return (int)(((unsigned long)addr >> 2) % SPINDLE_FUTEX_BUCKETS);
+}
+/* }}} */
+
+static inline int spindle_futex_wait(volatile int *addr, int val, const struct timespec *abstime) /* {{{ */
+{
+	int i = spindle_futex_bucket(addr), ret = 0;
+
+	pthread_mutex_lock(&spindle_futex_buckets[i].mutex);
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+		if (abstime) {
+			ret = pthread_cond_timedwait(&spindle_futex_buckets[i].cond, &spindle_futex_buckets[i].mutex, abstime);
+		} else {
+			pthread_cond_wait(&spindle_futex_buckets[i].cond, &spindle_futex_buckets[i].mutex);
+		}
+	}
+	pthread_mutex_unlock(&spindle_futex_buckets[i].mutex);
+	return (ret == ETIMEDOUT) ? ETIMEDOUT : 0;
+}
+/* }}} */
+
+static inline void spindle_futex_wake(volatile int *addr, int n) /* {{{ */
+{
+	int i = spindle_futex_bucket(addr);
+
+	/* the bucket is shared, so everybody is woken up */
+	pthread_mutex_lock(&spindle_futex_buckets[i].mutex);
+	pthread_cond_broadcast(&spindle_futex_buckets[i].cond);
+	pthread_mutex_unlock(&spindle_futex_buckets[i].mutex);
+}
+/* }}} */
+#endif
+
+static void spindle_slab_init(spindle_slab_t *slab, size_t obj_size) /* {{{ */
+{
+	memset(slab, 0, sizeof(spindle_slab_t));
+	/* keep objects from sharing cache lines */
+	slab->obj_size = (obj_size + SPINDLE_CACHELINE_SIZE - 1) & ~(size_t)(SPINDLE_CACHELINE_SIZE - 1);
+	pthread_mutex_init(&slab->grow_mutex, NULL);
+}
+/* }}} */
+
+static void spindle_slab_destroy(spindle_slab_t *slab) /* {{{ */
+{
+	int i;
+
+	for (i = 0; i < slab->nblocks; i++) {
+		free(slab->blocks[i]);
+	}
+	pthread_mutex_destroy(&slab->grow_mutex);
+}
+/* }}} */
+
+static inline spindle_slab_obj_t *spindle_slab_get(spindle_slab_t *slab, unsigned int index) /* {{{ */
+{
+	return (spindle_slab_obj_t *)(slab->blocks[index / SPINDLE_SLAB_BLOCK] + (index % SPINDLE_SLAB_BLOCK) * slab->obj_size);
+}
+/* }}} */
+
+/* the free list is a Treiber stack of object indexes, see stack_push() */
+static inline void spindle_slab_free(spindle_slab_t *slab, void *ptr) /* {{{ */
+{
+	spindle_slab_obj_t *obj = (spindle_slab_obj_t *)ptr;
+	unsigned long old, new;
+
+	old = __atomic_load_n(&slab->free_top, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&obj->next, (unsigned int)(old & 0xffffffffUL), __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | (obj->index + 1);
+	} while (!__atomic_compare_exchange_n(&slab->free_top, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+/* }}} */
+
+static void *spindle_slab_alloc(spindle_slab_t *slab) /* {{{ */
+{
+	spindle_slab_obj_t *obj;
+	unsigned long old, new;
+	char *block;
+	int i;
+
+	for ( ; ; ) {
+		old = __atomic_load_n(&slab->free_top, __ATOMIC_ACQUIRE);
+		while ((old & 0xffffffffUL) != 0) {
+			obj = spindle_slab_get(slab, (unsigned int)(old & 0xffffffffUL) - 1);
+			new = (((old >> 32) + 1) << 32) | __atomic_load_n(&obj->next, __ATOMIC_RELAXED);
+			if (__atomic_compare_exchange_n(&slab->free_top, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				return obj;
+			}
+		}
+
+		/* the free list is empty, add another block of objects */
+		pthread_mutex_lock(&slab->grow_mutex);
+		if ((__atomic_load_n(&slab->free_top, __ATOMIC_ACQUIRE) & 0xffffffffUL) != 0) {
+			/* somebody else has done that already */
+			pthread_mutex_unlock(&slab->grow_mutex);
+			continue;
+		}
+
+		if (slab->nblocks == SPINDLE_SLAB_MAX_BLOCKS || 0 != posix_memalign((void **)&block, SPINDLE_CACHELINE_SIZE, SPINDLE_SLAB_BLOCK * slab->obj_size)) {
+			pthread_mutex_unlock(&slab->grow_mutex);
+			return NULL;
+		}
+		memset(block, 0, SPINDLE_SLAB_BLOCK * slab->obj_size);
+		__atomic_store_n(&slab->blocks[slab->nblocks], block, __ATOMIC_RELEASE);
+
+		/* keep the first object for ourselves */
+		for (i = SPINDLE_SLAB_BLOCK - 1; i >= 0; i--) {
+			obj = (spindle_slab_obj_t *)(block + i * slab->obj_size);
+			obj->index = slab->nblocks * SPINDLE_SLAB_BLOCK + i;
+			if (i > 0) {
+				spindle_slab_free(slab, obj);
+			}
+		}
+		slab->nblocks++;
+		pthread_mutex_unlock(&slab->grow_mutex);
+		return obj;
+	}
+}
+/* }}} */
+
+/* copies only the argument bytes in use, most jobs have none; src must not change meanwhile */
+static inline void spindle_job_copy(spindle_job_t *dst, const spindle_job_t *src) /* {{{ */
+{
+	memcpy(dst, src, offsetof(spindle_job_t, data) + src->len);
+}
+/* }}} */
+
+static inline void queue_store_job(spindle_queue_head_t *job_queue, unsigned long idx, const spindle_job_t *job) /* {{{ */
+{
+	memcpy(&job_queue->slots[idx].job, job, sizeof(spindle_job_head_t));
+	if (job->len) {
+		memcpy(job_queue->args[idx].data, job->data, job->len);
+	}
+}
+/* }}} */
+
+static inline void queue_load_job(spindle_queue_head_t *job_queue, unsigned long idx, spindle_job_t *job) /* {{{ */
+{
+	memcpy(job, &job_queue->slots[idx].job, sizeof(spindle_job_head_t));
+	if (job->len) {
+		memcpy(job->data, job_queue->args[idx].data, job->len);
+	}
+}
+/* }}} */
+
+static inline int queue_init(spindle_queue_head_t *job_queue, int max_cap, int order) /* {{{ */
+{
+	unsigned long size, i;
+
+	if (max_cap <= 0) {
+		max_cap = SPINDLE_DEFAULT_MAX_QUEUE_SIZE;
+	}
+
+	/* the ring size has to be a power of two */
+	for (size = 2; size < (unsigned long)max_cap; size <<= 1);
+
+	if (0 != posix_memalign((void **)&job_queue->slots, SPINDLE_CACHELINE_SIZE, size * sizeof(spindle_queue_slot_t))) {
+		return -1;
+	}
+
+	/* calloc() leaves the pages alone until somebody dispatches a job with arguments */
+	job_queue->args = calloc(size, sizeof(spindle_job_args_t));
+	if (job_queue->args == NULL) {
+		free(job_queue->slots);
+		return -1;
 	}
 
-	job_queue->capacity = initial_cap;
-	job_queue->posted = 0;
-	if (max_cap > 0) {
-		job_queue->max_capacity = max_cap;
+	job_queue->mask = size - 1;
+	job_queue->max_capacity = max_cap;
+	job_queue->order = order;
+	job_queue->high_water = max_cap;
+	job_queue->low_water = SPINDLE_LOW_WATER(max_cap);
+	job_queue->full = 0;
+	job_queue->peak = 0;
+	job_queue->enqueue_pos = 0;
+	job_queue->dequeue_pos = 0;
+	job_queue->job_top = 0;
+
+	if (order == SPINDLE_QUEUE_LIFO) {
+		/* all the slots start on the free stack, linked through seq */
+		for (i = 0; i < size; i++) {
+			job_queue->slots[i].seq = (i + 1 < size) ? i + 2 : 0;
+		}
+		job_queue->free_top = 1;
 	} else {
-		job_queue->max_capacity = SPINDLE_DEFAULT_MAX_QUEUE_SIZE;
+		for (i = 0; i < size; i++) {
+			job_queue->slots[i].seq = i;
+		}
+		job_queue->free_top = 0;
+	}
+	return 0;
+}
+/* }}} */
+
+static inline void queue_free(spindle_queue_head_t *queue) /* {{{ */
+{
+	free(queue->slots);
+	free(queue->args);
+}
+/* }}} */
+
+static inline int queue_get_posted(spindle_queue_head_t *job_queue) /* {{{ */
+{
+	unsigned long head, tail;
+
+	tail = __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&job_queue->enqueue_pos, __ATOMIC_RELAXED);
+	return (head > tail) ? (int)(head - tail) : 0;
+}
+/* }}} */
+
+/* admission with hysteresis: a queue that has reached its high water mark stays closed
+ * until it drains to the low water mark, so that blocked dispatchers are woken up
+ * once per batch of free slots instead of once per slot */
+static inline int queue_is_open(spindle_queue_head_t *job_queue) /* {{{ */
+{
+	if (!__atomic_load_n(&job_queue->full, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+	if (queue_get_posted(job_queue) > job_queue->low_water) {
+		return 0;
+	}
+	__atomic_store_n(&job_queue->full, 0, __ATOMIC_RELAXED);
+	return 1;
+}
+/* }}} */
+
+static inline void queue_note_depth(spindle_queue_head_t *job_queue, int depth) /* {{{ */
+{
+	int peak = __atomic_load_n(&job_queue->peak, __ATOMIC_RELAXED);
+
+	while (depth > peak && !__atomic_compare_exchange_n(&job_queue->peak, &peak, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+/* }}} */
+
+static inline void queue_close(spindle_queue_head_t *job_queue) /* {{{ */
+{
+	queue_note_depth(job_queue, job_queue->high_water);
+	if (!__atomic_load_n(&job_queue->full, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&job_queue->full, 1, __ATOMIC_RELAXED);
+	}
+}
+/* }}} */
+
+/* Treiber stack of slot indexes for SPINDLE_QUEUE_LIFO, the top word holds
+ * the index + 1 of the top slot in the low half and an ABA counter in the high half */
+static inline void stack_push(spindle_queue_head_t *job_queue, unsigned long *top, unsigned long idx) /* {{{ */
+{
+	unsigned long old, new;
+
+	old = __atomic_load_n(top, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&job_queue->slots[idx].seq, old & 0xffffffffUL, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | (idx + 1);
+	} while (!__atomic_compare_exchange_n(top, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+/* }}} */
+
+static inline long stack_pop(spindle_queue_head_t *job_queue, unsigned long *top) /* {{{ */
+{
+	unsigned long old, new, idx;
+
+	old = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+	do {
+		if ((old & 0xffffffffUL) == 0) {
+			return -1;
+		}
+		idx = (old & 0xffffffffUL) - 1;
+		/* may be stale if the slot has been popped meanwhile, the counter makes the CAS fail then */
+		new = (((old >> 32) + 1) << 32) | __atomic_load_n(&job_queue->slots[idx].seq, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(top, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return (long)idx;
+}
+/* }}} */
+
+static inline int queue_lifo_post_job(spindle_queue_head_t *job_queue, const spindle_job_t *job) /* {{{ */
+{
+	long idx;
+
+	/* the counters are updated after the stacks, so the limit is approximate here */
+	if (queue_get_posted(job_queue) >= job_queue->high_water) {
+		queue_close(job_queue);
+		return -1;
+	}
+
+	idx = stack_pop(job_queue, &job_queue->free_top);
+	if (idx < 0) {
+		queue_close(job_queue);
+		return -1;
+	}
+	queue_store_job(job_queue, idx, job);
+	if ((__atomic_add_fetch(&job_queue->enqueue_pos, 1, __ATOMIC_RELAXED) & (SPINDLE_PEAK_SAMPLE - 1)) == 0) {
+		queue_note_depth(job_queue, queue_get_posted(job_queue));
+	}
+	stack_push(job_queue, &job_queue->job_top, idx);
+	return 0;
+}
+/* }}} */
+
+static inline int queue_lifo_fetch_job(spindle_queue_head_t *job_queue, spindle_job_t *job) /* {{{ */
+{
+	long idx = stack_pop(job_queue, &job_queue->job_top);
+
+	if (idx < 0) {
+		return 0;
+	}
+	queue_load_job(job_queue, idx, job);
+	__atomic_add_fetch(&job_queue->dequeue_pos, 1, __ATOMIC_RELAXED);
+	stack_push(job_queue, &job_queue->free_top, idx);
+	return 1;
+}
+/* }}} */
+
+/* Vyukov's bounded MPMC queue: a slot's sequence number tells whether it's free
+ * for the producer at position pos (seq == pos) or filled for the consumer (seq == pos + 1) */
+static inline int queue_post_job(spindle_queue_head_t *job_queue, const spindle_job_t *job) /* {{{ */
+{
+	spindle_queue_slot_t *slot;
+	unsigned long pos, seq;
+	long dif;
+
+	if (!queue_is_open(job_queue)) {
+		return -1;
+	}
+
+	if (job_queue->order == SPINDLE_QUEUE_LIFO) {
+		return queue_lifo_post_job(job_queue, job);
+	}
+
+	pos = __atomic_load_n(&job_queue->enqueue_pos, __ATOMIC_RELAXED);
+	for ( ; ; ) {
+		slot = &job_queue->slots[pos & job_queue->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			/* the ring itself is the limit when the requested size is a power of two,
+			   otherwise check it against the consumers' position, which may only lag behind */
+			if (job_queue->mask + 1 > (unsigned long)job_queue->high_water
+					&& pos - __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_RELAXED) >= (unsigned long)job_queue->high_water) {
+				queue_close(job_queue);
+				return -1;
+			}
+			if (__atomic_compare_exchange_n(&job_queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* full */
+			queue_close(job_queue);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&job_queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	queue_store_job(job_queue, pos & job_queue->mask, job);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (((pos + 1) & (SPINDLE_PEAK_SAMPLE - 1)) == 0) {
+		queue_note_depth(job_queue, queue_get_posted(job_queue));
+	}
+	return 0;
+}
+/* }}} */
+
+static inline int queue_fetch_job(spindle_queue_head_t *job_queue, spindle_job_t *job) /* {{{ */
+{
+	spindle_queue_slot_t *slot;
+	unsigned long pos, seq;
+	long dif;
+
+	if (job_queue->order == SPINDLE_QUEUE_LIFO) {
+		return queue_lifo_fetch_job(job_queue, job);
+	}
+
+	pos = __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_RELAXED);
+	for ( ; ; ) {
+		slot = &job_queue->slots[pos & job_queue->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&job_queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* empty */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	queue_load_job(job_queue, pos & job_queue->mask, job);
+	__atomic_store_n(&slot->seq, pos + job_queue->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+/* }}} */
+
+/* reserves up to n consecutive slots with a single CAS and fills them, returns the number of jobs posted */
+static inline int queue_post_jobs(spindle_queue_head_t *job_queue, spindle_barrier_t *barrier, const spindle_batch_job_t *jobs, int n, unsigned long queued) /* {{{ */
+{
+	spindle_queue_slot_t *slot;
+	unsigned long pos, tail;
+	long room;
+	int i, k;
+
+	if (!queue_is_open(job_queue)) {
+		return 0;
+	}
+
+	if (job_queue->order == SPINDLE_QUEUE_LIFO) {
+		spindle_job_t job = {0};
+
+		job.barrier = barrier;
+		job.queued = queued;
+		for (k = 0; k < n; k++) {
+			job.func = jobs[k].func;
+			job.arg = jobs[k].arg;
+			job.cleanup_func = jobs[k].cleanup_func;
+			job.cleanup_arg = jobs[k].cleanup_arg;
+			if (0 != queue_lifo_post_job(job_queue, &job)) {
+				break;
+			}
+		}
+		return k;
+	}
+
+	pos = __atomic_load_n(&job_queue->enqueue_pos, __ATOMIC_RELAXED);
+	for ( ; ; ) {
+		tail = __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_ACQUIRE);
+		room = (long)job_queue->high_water - (long)(pos - tail);
+		if (room <= 0) {
+			queue_close(job_queue);
+			return 0;
+		}
+		k = (room < n) ? (int)room : n;
+		if (__atomic_compare_exchange_n(&job_queue->enqueue_pos, &pos, pos + k, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	queue_note_depth(job_queue, (int)(pos + k - tail));
+
+	for (i = 0; i < k; i++) {
+		slot = &job_queue->slots[(pos + i) & job_queue->mask];
+		/* the consumer of the previous lap has already claimed this slot, but may not have released it yet */
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i) {
+			sched_yield();
+		}
+		slot->job.func = jobs[i].func;
+		slot->job.arg = jobs[i].arg;
+		slot->job.cleanup_func = jobs[i].cleanup_func;
+		slot->job.cleanup_arg = jobs[i].cleanup_arg;
+		slot->job.barrier = barrier;
+		slot->job.queued = queued;
+		slot->job.len = 0;
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+/* }}} */
+
+static inline int queue_can_accept_order(spindle_queue_head_t *job_queue) /* {{{ */
+{
+	return queue_is_open(job_queue) && queue_get_posted(job_queue) < job_queue->high_water;
+}
+/* }}} */
+
+static inline int queue_is_job_available(spindle_queue_head_t *job_queue) /* {{{ */
+{
+	unsigned long pos = __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_RELAXED);
+
+	if (job_queue->order == SPINDLE_QUEUE_LIFO) {
+		return (__atomic_load_n(&job_queue->job_top, __ATOMIC_ACQUIRE) & 0xffffffffUL) != 0;
+	}
+	return __atomic_load_n(&job_queue->slots[pos & job_queue->mask].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+/* }}} */
+
+/* returns the enqueue time of the job that would be fetched next, 0 if there's none */
+static inline unsigned long queue_peek_queued(spindle_queue_head_t *job_queue) /* {{{ */
+{
+	unsigned long pos, top;
+
+	/* the slot may be taken and reused while we're looking, but it's only a hint */
+	if (job_queue->order == SPINDLE_QUEUE_LIFO) {
+		top = __atomic_load_n(&job_queue->job_top, __ATOMIC_ACQUIRE) & 0xffffffffUL;
+		return top ? __atomic_load_n(&job_queue->slots[top - 1].job.queued, __ATOMIC_RELAXED) : 0;
+	}
+
+	pos = __atomic_load_n(&job_queue->dequeue_pos, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&job_queue->slots[pos & job_queue->mask].seq, __ATOMIC_ACQUIRE) != pos + 1) {
+		return 0;
+	}
+	return __atomic_load_n(&job_queue->slots[pos & job_queue->mask].job.queued, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+/* allocates one queue per priority level */
+static spindle_queue_head_t *spindle_queues_create(int levels, int max_cap, int order) /* {{{ */
+{
+	spindle_queue_head_t *queues;
+	int i;
+
+	if (0 != posix_memalign((void **)&queues, SPINDLE_CACHELINE_SIZE, levels * sizeof(spindle_queue_head_t))) {
+		return NULL;
+	}
+
+	for (i = 0; i < levels; i++) {
+		if (0 != queue_init(&queues[i], max_cap, order)) {
+			while (--i >= 0) {
+				queue_free(&queues[i]);
+			}
+			free(queues);
+			return NULL;
+		}
+	}
+	return queues;
+}
+/* }}} */
+
+static void spindle_queues_destroy(spindle_queue_head_t *queues, int levels) /* {{{ */
+{
+	int i;
+
+	for (i = 0; i < levels; i++) {
+		queue_free(&queues[i]);
+	}
+	free(queues);
+}
+/* }}} */
+
+#ifdef SPINDLE_HAVE_NUMA
+/* parses a sysfs CPU list like "0-3,8-11", returns the number of CPUs */
+static int spindle_parse_cpulist(const char *list, cpu_set_t *cpus) /* {{{ */
+{
+	char *end;
+	long first, last;
+
+	CPU_ZERO(cpus);
+	for ( ; ; ) {
+		first = strtol(list, &end, 10);
+		if (end == list || first < 0) {
+			break;
+		}
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list) {
+				break;
+			}
+		}
+		for ( ; first <= last && first < CPU_SETSIZE; first++) {
+			CPU_SET(first, cpus);
+		}
+		if (*end != ',') {
+			break;
+		}
+		list = end + 1;
+	}
+	return CPU_COUNT(cpus);
+}
+/* }}} */
+
+static int spindle_compare_int(const void *a, const void *b) /* {{{ */
+{
+	return *(const int *)a - *(const int *)b;
+}
+/* }}} */
+
+/* reads the CPUs of the NUMA nodes from /sys/devices/system/node, nodes without CPUs are skipped;
+ * returns the number of nodes found */
+static int spindle_numa_topology(cpu_set_t *cpus) /* {{{ */
+{
+	int ids[SPINDLE_MAX_NODES];
+	char path[PATH_MAX], list[4096];
+	struct dirent *entry;
+	DIR *dir;
+	FILE *f;
+	int i, n = 0, found = 0;
+
+	dir = opendir("/sys/devices/system/node");
+	if (dir == NULL) {
+		return 0;
+	}
+	while ((entry = readdir(dir)) != NULL && n < SPINDLE_MAX_NODES) {
+		if (sscanf(entry->d_name, "node%d", &ids[n]) == 1) {
+			n++;
+		}
+	}
+	closedir(dir);
+	qsort(ids, n, sizeof(int), spindle_compare_int);
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+		f = fopen(path, "r");
+		if (f == NULL) {
+			continue;
+		}
+		if (fgets(list, sizeof(list), f) && spindle_parse_cpulist(list, &cpus[found]) > 0) {
+			found++;
+		}
+		fclose(f);
+	}
+	return found;
+}
+/* }}} */
+
+/* moves the calling thread to the CPUs of the node for a while, so that the memory it touches
+ * first is allocated there (first touch policy); returns 1 if the old affinity has to be restored */
+static int spindle_node_enter(spindle_t *pool, int node, cpu_set_t *saved) /* {{{ */
+{
+	if (pool->nodes == NULL || 0 != pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), saved)) {
+		return 0;
+	}
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pool->nodes[node].cpus);
+}
+/* }}} */
+
+static void spindle_node_leave(cpu_set_t *saved) /* {{{ */
+{
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), saved);
+}
+/* }}} */
+#endif
+
+/* splits a NUMA-aware pool into nodes, each with its own queue allocated on the node;
+ * single node machines and systems without affinity support get a plain pool */
+static int spindle_nodes_create(spindle_t *pool, int max_cap, int order) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_NUMA
+	cpu_set_t cpus[SPINDLE_MAX_NODES], saved;
+	int i, cpu, n, bound;
+
+	n = spindle_numa_topology(cpus);
+	if (n < 2) {
+		return 0;
+	}
+
+	pool->cpu_node = malloc(CPU_SETSIZE * sizeof(int));
+	if (pool->cpu_node == NULL) {
+		return -1;
+	}
+	if (0 != posix_memalign((void **)&pool->nodes, SPINDLE_CACHELINE_SIZE, n * sizeof(spindle_node_t))) {
+		free(pool->cpu_node);
+		pool->cpu_node = NULL;
+		return -1;
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		pool->cpu_node[cpu] = -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		pool->nodes[i].cpus = cpus[i];
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &cpus[i])) {
+				pool->cpu_node[cpu] = i;
+			}
+		}
+
+		bound = spindle_node_enter(pool, i, &saved);
+		if (0 != queue_init(&pool->nodes[i].queue, max_cap, order)) {
+			if (bound) {
+				spindle_node_leave(&saved);
+			}
+			while (--i >= 0) {
+				queue_free(&pool->nodes[i].queue);
+			}
+			free(pool->nodes);
+			free(pool->cpu_node);
+			pool->nodes = NULL;
+			pool->cpu_node = NULL;
+			return -1;
+		}
+		if (bound) {
+			spindle_node_leave(&saved);
+		}
+	}
+	pool->nnodes = n;
+#endif
+	return 0;
+}
+/* }}} */
+
+static void spindle_nodes_destroy(spindle_t *pool) /* {{{ */
+{
+	int i;
+
+	if (pool->nodes) {
+		for (i = 0; i < pool->nnodes; i++) {
+			queue_free(&pool->nodes[i].queue);
+		}
+		free(pool->nodes);
+		free(pool->cpu_node);
+		pool->nodes = NULL;
+		pool->cpu_node = NULL;
+	}
+}
+/* }}} */
+
+static inline unsigned long spindle_now_usec(void) /* {{{ */
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+/* }}} */
+
+/* precise counterpart of spindle_now_usec() for the statistics */
+static inline unsigned long spindle_clock_usec(void) /* {{{ */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+/* }}} */
+
+/* counters have a single writer, so they don't need atomic increments, just atomic stores */
+static inline void spindle_stat_add(unsigned long *counter, unsigned long n) /* {{{ */
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+/* log-linear histogram bucket (HDR style): 0..3 usec get a bucket each,
+ * then every power of two is split into four */
+static inline int spindle_stats_bucket(unsigned long usec) /* {{{ */
+{
+	int msb, bucket;
+
+	if (usec < 4) {
+		return (int)usec;
+	}
+	msb = 63 - __builtin_clzl(usec);
+	bucket = ((msb - 1) << 2) | (int)((usec >> (msb - 2)) & 3);
+	return (bucket < SPINDLE_STATS_BUCKETS) ? bucket : SPINDLE_STATS_BUCKETS - 1;
+}
+/* }}} */
+
+
+/* the worker the current thread belongs to, NULL in non-pool threads */
+static __thread spindle_worker_t *spindle_current_worker = NULL;
+
+static inline int deque_push(spindle_deque_t *deque, const spindle_job_t *job) /* {{{ */
+{
+	long b, t;
+
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	if (b - t >= SPINDLE_DEQUE_SIZE) {
+		return -1;
+	}
+
+	spindle_job_copy(&deque->jobs[b & (SPINDLE_DEQUE_SIZE - 1)], job);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+/* }}} */
+
+static inline int deque_pop(spindle_deque_t *deque, spindle_job_t *job) /* {{{ */
+{
+	long b, t;
+	int ret = 0;
+
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		/* empty */
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	spindle_job_copy(job, &deque->jobs[b & (SPINDLE_DEQUE_SIZE - 1)]);
+	if (t == b) {
+		/* the last job, race against thieves */
+		ret = __atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return ret;
+	}
+	return 1;
+}
+/* }}} */
+
+static inline int deque_steal(spindle_deque_t *deque, spindle_job_t *job) /* {{{ */
+{
+	long b, t;
+
+	t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b) {
+		return 0;
+	}
+
+	/* the copy may be torn if the owner has wrapped around meanwhile, but then the CAS fails and we drop it */
+	*job = deque->jobs[t & (SPINDLE_DEQUE_SIZE - 1)];
+	return __atomic_compare_exchange_n(&deque->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+static inline long deque_size(spindle_deque_t *deque) /* {{{ */
+{
+	long b, t;
+
+	t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	return (b > t) ? b - t : 0;
+}
+/* }}} */
+
+#ifdef SPINDLE_DEBUG
+static inline void etfprintf(struct timeval then, ...) /* {{{ */
+{
+	va_list         args;
+	struct timeval  now;
+	struct timeval  diff;
+	FILE           *out;
+	char           *fmt;
+
+	va_start(args, then);
+	out = va_arg(args, FILE *);
+	fmt = va_arg(args, char *);
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &then, &diff);
+	fprintf(out, "%03d.%06d:", (int)diff.tv_sec, (int)diff.tv_usec);
+	vfprintf(out, fmt, args);
+	fflush(NULL);
+	va_end(args);
+}
+/* }}} */
+#endif
+
+static void spindle_mutex_unlock_wrapper(void *data) /* {{{ */
+{
+	pthread_mutex_t *mutex = (pthread_mutex_t *)data;
+	pthread_mutex_unlock(mutex);
+}
+/* }}} */
+
+static inline void spindle_cpu_relax(void) /* {{{ */
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+/* }}} */
+
+/* protects the list of sleeping workers, which is held for a few instructions only */
+static inline void spindle_spin_lock(volatile int *lock) /* {{{ */
+{
+	int i;
+
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		for (i = 0; __atomic_load_n(lock, __ATOMIC_RELAXED); i++) {
+			if (i < 64) {
+				spindle_cpu_relax();
+			} else {
+				/* the holder has probably been preempted */
+				sched_yield();
+			}
+		}
+	}
+}
+/* }}} */
+
+static inline void spindle_spin_unlock(volatile int *lock) /* {{{ */
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+/* }}} */
+
+/* takes the worker off the list of sleeping workers, must be called with parked_lock held */
+static inline void spindle_unpark(spindle_t *pool, spindle_worker_t *worker) /* {{{ */
+{
+	int i;
+
+	for (i = worker->parked_at; i < pool->nparked - 1; i++) {
+		pool->parked[i] = pool->parked[i + 1];
+		pool->parked[i]->parked_at = i;
+	}
+	__atomic_store_n(&pool->nparked, pool->nparked - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&worker->parked_at, -1, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+/* takes the most recently idle worker off the list, its caches are the warmest */
+static inline spindle_worker_t *spindle_pop_parked(spindle_t *pool) /* {{{ */
+{
+	spindle_worker_t *worker = NULL;
+
+	if (__atomic_load_n(&pool->nparked, __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	spindle_spin_lock(&pool->parked_lock);
+	if (pool->nparked > 0) {
+		worker = pool->parked[pool->nparked - 1];
+		spindle_unpark(pool, worker);
+	}
+	spindle_spin_unlock(&pool->parked_lock);
+	return worker;
+}
+/* }}} */
+
+/* the worker is off the list already, nobody else wakes it up */
+static inline void spindle_unpark_wake(spindle_worker_t *worker) /* {{{ */
+{
+	__atomic_store_n(&worker->wake, 1, __ATOMIC_RELEASE);
+	spindle_futex_wake(&worker->wake, 1);
+}
+/* }}} */
+
+static inline int spindle_wake_parked(spindle_t *pool, int n) /* {{{ */
+{
+	spindle_worker_t *worker;
+
+	while (n > 0 && (worker = spindle_pop_parked(pool)) != NULL) {
+		spindle_unpark_wake(worker);
+		n--;
+	}
+	/* the wakeups nobody was asleep for */
+	return n;
+}
+/* }}} */
+
+/* wakes up to n sleeping workers, must be called after the jobs are made visible.
+ * While somebody is spinning the wakeups are left to the spinners instead: the first one
+ * to stop spinning takes them over, see spindle_park() */
+static inline void spindle_wake_idle_n(spindle_t *pool, int n) /* {{{ */
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (n <= 0) {
+		return;
+	}
+	if (__atomic_load_n(&pool->idle, __ATOMIC_RELAXED) == 0) {
+		/* every worker of the lane is busy, idle ones of the pool may help out */
+		if (__atomic_load_n(&pool->spill, __ATOMIC_ACQUIRE)) {
+			spindle_wake_idle_n(pool->parent, n);
+		}
+		return;
+	}
+	/* spindle_resume() wakes them all anyway */
+	if (__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	if (__atomic_load_n(&pool->spinning, __ATOMIC_RELAXED) > 0) {
+		__atomic_add_fetch(&pool->skipped, n, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&pool->spinning, __ATOMIC_SEQ_CST) > 0) {
+			return;
+		}
+		/* the spinners have stopped in the meantime, perhaps before they could see these */
+		n = __atomic_exchange_n(&pool->skipped, 0, __ATOMIC_SEQ_CST);
+	}
+
+	n = spindle_wake_parked(pool, n);
+	if (n > 0 && __atomic_load_n(&pool->spill, __ATOMIC_ACQUIRE)) {
+		spindle_wake_idle_n(pool->parent, n);
+	}
+}
+/* }}} */
+
+/* wakes up all the sleeping workers, spinning or not */
+static inline void spindle_wake_all(spindle_t *pool) /* {{{ */
+{
+	spindle_worker_t *worker;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while ((worker = spindle_pop_parked(pool)) != NULL) {
+		spindle_unpark_wake(worker);
+	}
+}
+/* }}} */
+
+/* wakes up the given worker if it's sleeping, must be called after its job is made visible */
+static inline void spindle_wake_worker(spindle_t *pool, spindle_worker_t *worker) /* {{{ */
+{
+	int parked;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&worker->parked_at, __ATOMIC_RELAXED) < 0) {
+		return;
+	}
+
+	spindle_spin_lock(&pool->parked_lock);
+	parked = (worker->parked_at >= 0);
+	if (parked) {
+		spindle_unpark(pool, worker);
+	}
+	spindle_spin_unlock(&pool->parked_lock);
+
+	if (parked) {
+		spindle_unpark_wake(worker);
+	}
+}
+/* }}} */
+
+static inline void spindle_wake_idle(spindle_t *pool) /* {{{ */
+{
+	spindle_wake_idle_n(pool, 1);
+}
+/* }}} */
+
+#ifdef SPINDLE_HAVE_FIBERS
+/* the fiber the current thread is running, NULL on the worker's own stack */
+static __thread spindle_fiber_t *spindle_current_fiber = NULL;
+
+/* fibers sleeping on a word, hashed by its address (see spindle_fiber_wait()) */
+#define SPINDLE_FIBER_BUCKETS 64
+
+static struct {
+	volatile int lock;
+	spindle_fiber_t *head;
+} spindle_fiber_buckets[SPINDLE_FIBER_BUCKETS];
+static int spindle_fiber_sleepers = 0;
+
+/* a fiber may go on on another thread after it has been suspended, and the compiler
+ * is free to keep the address of a thread local variable across calls: the functions
+ * that suspend fibers look their fiber up through this one */
+static __attribute__((noinline)) spindle_fiber_t *spindle_fiber_self(void) /* {{{ */
+{
+	return spindle_current_fiber;
+}
+/* }}} */
+
+static inline int spindle_fiber_bucket(volatile int *addr) /* {{{ */
+{
+	return (int)(((unsigned long)addr >> 2) % SPINDLE_FIBER_BUCKETS);
+}
+/* }}} */
+
+/* queues a fiber that can go on for the workers, which resume it before taking new jobs */
+static void spindle_fiber_ready(spindle_fiber_t *fiber) /* {{{ */
+{
+	spindle_t *pool = fiber->pool;
+
+	fiber->next = NULL;
+	spindle_spin_lock(&pool->fiber_lock);
+	if (pool->ready_tail) {
+		pool->ready_tail->next = fiber;
+	} else {
+		pool->ready_head = fiber;
+	}
+	pool->ready_tail = fiber;
+	__atomic_add_fetch(&pool->nready, 1, __ATOMIC_SEQ_CST);
+	spindle_spin_unlock(&pool->fiber_lock);
+	spindle_wake_idle(pool);
+}
+/* }}} */
+
+/* switches back to the worker stack, where the worker runs action (if any) before it goes on;
+ * returns once the fiber is resumed, possibly by another worker */
+static __attribute__((noinline)) void spindle_fiber_suspend(spindle_fiber_t *fiber, void (*action)(spindle_fiber_t *)) /* {{{ */
+{
+	fiber->worker->fiber_action = action;
+	swapcontext(&fiber->ctx, &fiber->worker->fiber_ctx);
+}
+/* }}} */
+
+/* runs on the worker stack once the fiber is off its own, so that a waker can't resume it too early */
+static void spindle_fiber_sleep(spindle_fiber_t *fiber) /* {{{ */
+{
+	int i = spindle_fiber_bucket(fiber->wait_addr);
+
+	/* pairs with the store of the waker: either it sees the sleeper, or we see the new value */
+	__atomic_add_fetch(&spindle_fiber_sleepers, 1, __ATOMIC_SEQ_CST);
+	spindle_spin_lock(&spindle_fiber_buckets[i].lock);
+	if (__atomic_load_n(fiber->wait_addr, __ATOMIC_SEQ_CST) == fiber->wait_val) {
+		fiber->next = spindle_fiber_buckets[i].head;
+		spindle_fiber_buckets[i].head = fiber;
+		spindle_spin_unlock(&spindle_fiber_buckets[i].lock);
+		return;
+	}
+	spindle_spin_unlock(&spindle_fiber_buckets[i].lock);
+	__atomic_sub_fetch(&spindle_fiber_sleepers, 1, __ATOMIC_SEQ_CST);
+	spindle_fiber_ready(fiber);
+}
+/* }}} */
+
+/* spindle_futex_wait() for fibers: suspends the fiber while *addr == val,
+ * the worker runs other jobs meanwhile. Spurious wakeups are possible */
+static void spindle_fiber_wait(spindle_fiber_t *fiber, volatile int *addr, int val) /* {{{ */
+{
+	fiber->wait_addr = addr;
+	fiber->wait_val = val;
+	spindle_fiber_suspend(fiber, spindle_fiber_sleep);
+}
+/* }}} */
+
+/* spindle_futex_wake() for fibers, touches nothing but the address itself */
+static void spindle_fiber_wake(volatile int *addr) /* {{{ */
+{
+	spindle_fiber_t *fiber, **prev, *woken = NULL;
+	int i, n = 0;
+
+	if (__atomic_load_n(&spindle_fiber_sleepers, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	i = spindle_fiber_bucket(addr);
+	spindle_spin_lock(&spindle_fiber_buckets[i].lock);
+	prev = &spindle_fiber_buckets[i].head;
+	while ((fiber = *prev) != NULL) {
+		if (fiber->wait_addr == addr) {
+			*prev = fiber->next;
+			fiber->next = woken;
+			woken = fiber;
+			n++;
+		} else {
+			prev = &fiber->next;
+		}
+	}
+	spindle_spin_unlock(&spindle_fiber_buckets[i].lock);
+
+	if (n > 0) {
+		__atomic_sub_fetch(&spindle_fiber_sleepers, n, __ATOMIC_SEQ_CST);
+	}
+	while (woken) {
+		fiber = woken;
+		woken = fiber->next;
+		spindle_fiber_ready(fiber);
+	}
+}
+/* }}} */
+#else
+# define spindle_fiber_wake(addr)
+#endif
+
+/* sleeps while *addr == val like spindle_futex_wait(), but on a fiber only the fiber does,
+ * the worker is handed back to the pool (timed waits still hold it) */
+static inline int spindle_wait_word(volatile int *addr, int val, const struct timespec *abstime) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_FIBERS
+	spindle_fiber_t *fiber;
+
+	if (abstime == NULL && (fiber = spindle_fiber_self()) != NULL) {
+		spindle_fiber_wait(fiber, addr, val);
+		return 0;
+	}
+#endif
+	return spindle_futex_wait(addr, val, abstime);
+}
+/* }}} */
+
+static inline void spindle_barrier_add(spindle_barrier_t *b, int n) /* {{{ */
+{
+	__atomic_add_fetch(&b->pending, n, __ATOMIC_SEQ_CST);
+}
+/* }}} */
+
+static void spindle_barrier_signal(spindle_barrier_t *b) /* {{{ */
+{
+	/* only the last job wakes the waiters up; the barrier may be freed as soon
+	   as the counter drops, so the wakeup must not touch anything but the address */
+	if (__atomic_sub_fetch(&b->pending, 1, __ATOMIC_SEQ_CST) == SPINDLE_BARRIER_WAITERS) {
+		spindle_futex_wake(&b->pending, INT_MAX);
+		spindle_fiber_wake(&b->pending);
+	}
+}
+/* }}} */
+
+static inline void spindle_run_job(spindle_job_t *job) /* {{{ */
+{
+	void *arg = job->len ? (void *)job->data : job->arg;
+
+	if (job->cleanup_func != NULL) {
+		pthread_cleanup_push(job->cleanup_func, job->cleanup_arg);
+		job->func(arg);
+		pthread_cleanup_pop(1);
+	} else {
+		job->func(arg);
+	}
+
+	if (job->barrier) {
+		/* Job done! */
+		spindle_barrier_signal(job->barrier);
+	}
+}
+/* }}} */
+
+/* the slots of exited workers are scanned too: their memory is kept and their deques are empty
+ * (a worker exits only when it has nothing left), or hold jobs that are still worth stealing */
+static inline int spindle_steal_job(spindle_worker_t *self, spindle_job_t *job) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+	spindle_worker_t *victim;
+	int i, v, slots, pass;
+
+	slots = __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE);
+	self->seed = self->seed * 1103515245 + 12345;
+
+	/* NUMA-aware pools look at the workers of the same node first */
+	for (pass = (pool->nodes ? 0 : 1); pass < 2; pass++) {
+		v = (self->seed >> 16) % slots;
+		for (i = 0; i < slots; i++, v = (v + 1) % slots) {
+			victim = pool->workers[v];
+			if (v == self->id || (pool->nodes && (victim->node == self->node) != (pass == 0))) {
+				continue;
+			}
+			while (deque_size(&victim->deque) > 0) {
+				if (deque_steal(&victim->deque, job)) {
+					spindle_stat_add(&self->stats.steals, 1);
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+static inline int spindle_deques_empty(spindle_t *pool) /* {{{ */
+{
+	int i, slots;
+
+	slots = __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE);
+	for (i = 0; i < slots; i++) {
+		if (deque_size(&pool->workers[i]->deque) > 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+/* }}} */
+
+/* wakes up the dispatchers waiting for a free slot once a queue has reopened,
+ * must be called after a job is taken from the queue */
+static inline void spindle_wake_dispatcher(spindle_t *pool) /* {{{ */
+{
+	int i, open = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->blocked, __ATOMIC_RELAXED) > 0) {
+		for (i = 0; i < pool->priorities && !open; i++) {
+			open = queue_can_accept_order(&pool->job_queue[i]);
+		}
+		for (i = 0; pool->nodes && i < pool->nnodes && !open; i++) {
+			open = queue_can_accept_order(&pool->nodes[i].queue);
+		}
+		if (!open) {
+			/* still above the low water marks */
+			return;
+		}
+		__atomic_add_fetch(&pool->slots_freed, 1, __ATOMIC_SEQ_CST);
+		spindle_fiber_wake(&pool->slots_freed);
+		pthread_mutex_lock(&pool->mutex);
+		pthread_cond_broadcast(&pool->job_taken);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+/* }}} */
+
+/* takes the next job from the shared queues: the highest priority level first,
+ * unless a lower level has a job that has been waiting for longer than the aging limit.
+ * The node queues of NUMA-aware pools belong to the highest level, the worker's own node comes first */
+static inline int spindle_fetch_pool_job(spindle_t *pool, int node, spindle_job_t *job) /* {{{ */
+{
+	unsigned long now, queued, oldest_queued = 0;
+	int i, oldest = -1;
+
+	if (pool->priorities > 1 && pool->aging > 0) {
+		now = spindle_now_usec();
+		for (i = 1; i < pool->priorities; i++) {
+			queued = queue_peek_queued(&pool->job_queue[i]);
+			if (queued && now > queued && now - queued >= pool->aging && (oldest < 0 || queued < oldest_queued)) {
+				oldest = i;
+				oldest_queued = queued;
+			}
+		}
+		if (oldest > 0 && queue_fetch_job(&pool->job_queue[oldest], job)) {
+			return 1;
+		}
+	}
+
+	if (pool->nodes) {
+		for (i = 0; i < pool->nnodes; i++) {
+			if (queue_fetch_job(&pool->nodes[(node + i) % pool->nnodes].queue, job)) {
+				return 1;
+			}
+		}
+	}
+
+	for (i = 0; i < pool->priorities; i++) {
+		if (queue_fetch_job(&pool->job_queue[i], job)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+static inline int spindle_pool_job_available(spindle_t *pool) /* {{{ */
+{
+	int i;
+
+	for (i = 0; i < pool->priorities; i++) {
+		if (queue_is_job_available(&pool->job_queue[i])) {
+			return 1;
+		}
+	}
+
+	if (pool->nodes) {
+		for (i = 0; i < pool->nnodes; i++) {
+			if (queue_is_job_available(&pool->nodes[i].queue)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+/* wakes up the dispatchers of a tenant once its queue has reopened, see spindle_wake_dispatcher() */
+static inline void spindle_wake_tenant_dispatcher(spindle_t *pool, spindle_tenant_t *tenant) /* {{{ */
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&tenant->blocked, __ATOMIC_RELAXED) > 0 && queue_can_accept_order(&tenant->queue)) {
+		__atomic_add_fetch(&pool->slots_freed, 1, __ATOMIC_SEQ_CST);
+		spindle_fiber_wake(&pool->slots_freed);
+		pthread_mutex_lock(&pool->mutex);
+		pthread_cond_broadcast(&tenant->taken);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+/* }}} */
+
+/* takes the next job of the tenant with the lowest pass among those with jobs waiting; a tenant that
+ * has been idle starts from the current virtual time, so it can't claim the turns it didn't use */
+static int spindle_fetch_tenant_job(spindle_t *pool, int ntenants, int node, spindle_job_t *job) /* {{{ */
+{
+	spindle_tenant_t *tenant;
+	unsigned long vtime, pass, best_pass = 0;
+	int i, best, tried = 0;
+
+	vtime = __atomic_load_n(&pool->tenant_vtime, __ATOMIC_RELAXED);
+	for ( ; ; ) {
+		best = -1;
+		for (i = 0; i < ntenants; i++) {
+			tenant = pool->tenants[i];
+			if ((tried & (1 << i)) || !(i == 0 ? spindle_pool_job_available(pool) : queue_is_job_available(&tenant->queue))) {
+				continue;
+			}
+			pass = __atomic_load_n(&tenant->pass, __ATOMIC_RELAXED);
+			if (pass < vtime) {
+				pass = vtime;
+			}
+			if (best < 0 || pass < best_pass) {
+				best = i;
+				best_pass = pass;
+			}
+		}
+		if (best < 0) {
+			return 0;
+		}
+
+		tenant = pool->tenants[best];
+		if (best == 0 ? spindle_fetch_pool_job(pool, node, job) : queue_fetch_job(&tenant->queue, job)) {
+			/* racing workers may lose an update here and there, which only blurs the shares a little */
+			__atomic_store_n(&tenant->pass, best_pass + tenant->stride, __ATOMIC_RELAXED);
+			if (best_pass > vtime) {
+				__atomic_store_n(&pool->tenant_vtime, best_pass, __ATOMIC_RELAXED);
+			}
+			__atomic_add_fetch(&tenant->jobs, 1, __ATOMIC_RELAXED);
+			if (best > 0) {
+				spindle_wake_tenant_dispatcher(pool, tenant);
+			}
+			return 1;
+		}
+		/* somebody else got it */
+		tried |= 1 << best;
+	}
+}
+/* }}} */
+
+static inline int spindle_fetch_queued_job(spindle_t *pool, int node, spindle_job_t *job) /* {{{ */
+{
+	int ntenants = __atomic_load_n(&pool->ntenants, __ATOMIC_ACQUIRE);
+
+	if (ntenants == 0) {
+		return spindle_fetch_pool_job(pool, node, job);
+	}
+	return spindle_fetch_tenant_job(pool, ntenants, node, job);
+}
+/* }}} */
+
+static inline int spindle_queued_job_available(spindle_t *pool) /* {{{ */
+{
+	int i, ntenants = __atomic_load_n(&pool->ntenants, __ATOMIC_ACQUIRE);
+
+	for (i = 1; i < ntenants; i++) {
+		if (queue_is_job_available(&pool->tenants[i]->queue)) {
+			return 1;
+		}
+	}
+	return spindle_pool_job_available(pool);
+}
+/* }}} */
+
+static inline int spindle_get_job(spindle_worker_t *self, spindle_job_t *job) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+
+	/* own jobs first, LIFO for cache locality */
+	if (pool->scheduler == SPINDLE_SCHED_STEALING && deque_pop(&self->deque, job)) {
+		return 1;
+	}
+
+	/* then the ones nobody else may run */
+	if (queue_fetch_job(&self->mailbox, job)) {
+		return 1;
+	}
+
+	if (spindle_fetch_queued_job(pool, self->node, job)) {
+		spindle_wake_dispatcher(pool);
+		return 1;
+	}
+
+	if (pool->scheduler == SPINDLE_SCHED_STEALING && spindle_steal_job(self, job)) {
+		return 1;
+	}
+	return 0;
+}
+/* }}} */
+
+/* takes a job of the pool for a thread that's not one of its workers: no deque or mailbox of its own */
+static inline int spindle_fetch_foreign(spindle_t *pool, spindle_job_t *job) /* {{{ */
+{
+	int i, slots;
+
+	if (spindle_fetch_queued_job(pool, 0, job)) {
+		spindle_wake_dispatcher(pool);
+		return 1;
+	}
+
+	if (pool->scheduler == SPINDLE_SCHED_STEALING) {
+		slots = __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE);
+		for (i = 0; i < slots; i++) {
+			while (deque_size(&pool->workers[i]->deque) > 0) {
+				if (deque_steal(&pool->workers[i]->deque, job)) {
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+/* fills abstime (CLOCK_REALTIME) for a wait of usec microseconds */
+static inline void spindle_abstime(struct timespec *abstime, unsigned long usec) /* {{{ */
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	abstime->tv_sec = now.tv_sec + usec / 1000000;
+	abstime->tv_nsec = (now.tv_usec + usec % 1000000) * 1000;
+	if (abstime->tv_nsec >= 1000000000) {
+		abstime->tv_sec++;
+		abstime->tv_nsec -= 1000000000;
+	}
+}
+/* }}} */
+
+/* whether a lane spilling over to the pool has jobs waiting */
+static inline int spindle_spill_available(spindle_t *pool) /* {{{ */
+{
+	spindle_t *lane;
+	int i, n;
+
+	if (__atomic_load_n(&pool->spill_lanes, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	for (i = 1; i < n; i++) {
+		lane = pool->lanes[i];
+		if (__atomic_load_n(&lane->spill, __ATOMIC_RELAXED) && !__atomic_load_n(&lane->suspended, __ATOMIC_RELAXED)
+			&& (spindle_queued_job_available(lane) || (lane->scheduler == SPINDLE_SCHED_STEALING && !spindle_deques_empty(lane)))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+/* whether there may be something for the worker to do: a job for it or for anybody, a shrink or an exit */
+static inline int spindle_work_available(spindle_worker_t *self) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+
+	if (__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+	if (__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	return __atomic_load_n(&pool->size, __ATOMIC_RELAXED) > __atomic_load_n(&pool->target, __ATOMIC_RELAXED)
+		|| queue_is_job_available(&self->mailbox) || spindle_queued_job_available(pool)
+		|| __atomic_load_n(&pool->nready, __ATOMIC_RELAXED) > 0
+		|| (pool->scheduler == SPINDLE_SCHED_STEALING && !spindle_deques_empty(pool))
+		|| spindle_spill_available(pool);
+}
+/* }}} */
+
+/* lets the threads waiting in spindle_drain() or spindle_suspend() take another look */
+static inline void spindle_signal_quiet(spindle_t *pool) /* {{{ */
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->draining, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&pool->mutex);
+		pthread_cond_broadcast(&pool->quiet);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+/* }}} */
+
+/* takes a job of a lane spilling over to the pool for an idle worker, returns the lane or NULL;
+ * the job is counted in lane->foreign until spindle_spill_done() */
+static spindle_t *spindle_spill_job(spindle_t *pool, spindle_job_t *job) /* {{{ */
+{
+	spindle_t *lane;
+	int i, n;
+
+	if (__atomic_load_n(&pool->spill_lanes, __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	for (i = 1; i < n; i++) {
+		lane = pool->lanes[i];
+		if (!__atomic_load_n(&lane->spill, __ATOMIC_RELAXED) || __atomic_load_n(&lane->suspended, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		/* counted before spill is checked again, so that spindle_lanes_destroy() either waits for us or we see it */
+		__atomic_add_fetch(&lane->foreign, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&lane->spill, __ATOMIC_SEQ_CST) && spindle_fetch_foreign(lane, job)) {
+			return lane;
+		}
+		__atomic_sub_fetch(&lane->foreign, 1, __ATOMIC_SEQ_CST);
+		spindle_signal_quiet(lane);
+	}
+	return NULL;
+}
+/* }}} */
+
+static inline void spindle_spill_done(spindle_t *lane) /* {{{ */
+{
+	__atomic_sub_fetch(&lane->foreign, 1, __ATOMIC_SEQ_CST);
+	spindle_signal_quiet(lane);
+}
+/* }}} */
+
+/* waits until a job may have been posted: spins for a while, then yields the CPU, then sleeps on
+ * the worker's own futex until a dispatcher picks it. Returns ETIMEDOUT if the worker may retire instead */
+static int spindle_park(spindle_worker_t *self) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+	struct timespec abstime, *timeout = NULL;
+	unsigned long since;
+	int i, skipped, state, found = 0, ret = 0;
+
+	/* stats.parked != 0 also tells spindle_drain() the worker holds no job,
+	   released so that the effects of the jobs are visible to it */
+	since = spindle_clock_usec();
+	__atomic_store_n(&self->stats.parked, since, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+	spindle_signal_quiet(pool);
+
+	/* a few spinners are enough to pick up the next jobs without a wakeup */
+	if (pool->max_spinning > 0) {
+		if (__atomic_add_fetch(&pool->spinning, 1, __ATOMIC_SEQ_CST) <= pool->max_spinning) {
+			for (i = 0; i < pool->spin_count + pool->yield_count && !(found = spindle_work_available(self)); i++) {
+				if (i < pool->spin_count) {
+					spindle_cpu_relax();
+				} else {
+					sched_yield();
+				}
+			}
+		}
+		__atomic_sub_fetch(&pool->spinning, 1, __ATOMIC_SEQ_CST);
+
+		/* the dispatchers counted on the spinners: one job is ours, the others need somebody else */
+		skipped = __atomic_exchange_n(&pool->skipped, 0, __ATOMIC_SEQ_CST);
+		if (skipped > 0) {
+			found = 1;
+			spindle_wake_idle_n(pool, skipped - 1);
+		}
+	}
+
+	if (!found) {
+		if (pool->linger > 0 && __atomic_load_n(&pool->size, __ATOMIC_RELAXED) > pool->min_size) {
+			spindle_abstime(&abstime, pool->linger);
+			timeout = &abstime;
+		}
+
+		/* get on the list before the last look at the queues, so that
+		   a dispatcher either finds us there or we see its job */
+		__atomic_store_n(&self->wake, 0, __ATOMIC_RELAXED);
+		spindle_spin_lock(&pool->parked_lock);
+		__atomic_store_n(&self->parked_at, pool->nparked, __ATOMIC_RELAXED);
+		pool->parked[pool->nparked] = self;
+		__atomic_store_n(&pool->nparked, pool->nparked + 1, __ATOMIC_RELAXED);
+		spindle_spin_unlock(&pool->parked_lock);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (!spindle_work_available(self)) {
+			TP_DEBUG(pool, " <<< Thread[%d] waiting for signal.\n", self->id);
+			/* spindle_destroy_immediately() cancels the workers, then wakes them up */
+			pthread_testcancel();
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+			ret = spindle_futex_wait(&self->wake, 0, timeout);
+			pthread_setcancelstate(state, NULL);
+			if (__atomic_load_n(&self->wake, __ATOMIC_ACQUIRE)) {
+				spindle_stat_add(&self->stats.wakeups, 1);
+			}
+		}
+
+		/* still on the list after a timeout, a spurious wakeup or a job found by the last look */
+		if (__atomic_load_n(&self->parked_at, __ATOMIC_RELAXED) >= 0) {
+			spindle_spin_lock(&pool->parked_lock);
+			if (self->parked_at >= 0) {
+				spindle_unpark(pool, self);
+			}
+			spindle_spin_unlock(&pool->parked_lock);
+		}
+		pthread_testcancel();
+	}
+
+	/* busy again before the worker looks for a job */
+	spindle_stat_add(&self->stats.idle_usec, spindle_clock_usec() - since);
+	__atomic_store_n(&self->stats.parked, 0, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+/* }}} */
+
+/* decides whether the worker should exit: either the pool is above its target,
+ * or the worker has been idle for the linger time and the pool is above its minimum */
+static int spindle_worker_retire(spindle_worker_t *self, int lingered) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+	int retire;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (lingered) {
+		/* the job that timed out wait was about to be woken up for might be there already */
+		retire = pool->size > pool->min_size && !spindle_queued_job_available(pool) && (pool->scheduler != SPINDLE_SCHED_STEALING || spindle_deques_empty(pool));
+	} else {
+		retire = pool->size > pool->target && deque_size(&self->deque) == 0;
+	}
+	/* nobody else would run these */
+	retire = retire && !queue_is_job_available(&self->mailbox);
+	if (retire) {
+		__atomic_store_n(&pool->size, pool->size - 1, __ATOMIC_RELAXED);
+		if (pool->target > pool->size) {
+			__atomic_store_n(&pool->target, pool->size, __ATOMIC_RELAXED);
+		}
+		TP_DEBUG(pool, " <<< Thread[%d] retiring, %d workers left.\n", self->id, pool->size);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return retire;
+}
+/* }}} */
+
+#ifdef SPINDLE_HAVE_FIBERS
+/* entry point of the fibers: runs a job each time it's switched to, the stack is reused as it is */
+static void spindle_fiber_main(void) /* {{{ */
+{
+	spindle_fiber_t *fiber = spindle_fiber_self();
+
+	for ( ; ; ) {
+		spindle_run_job(&fiber->job);
+		fiber->done = 1;
+		swapcontext(&fiber->ctx, &fiber->worker->fiber_ctx);
+	}
+}
+/* }}} */
+
+/* sets up the context of a new fiber to start in spindle_fiber_main() on its stack above the guard page;
+ * kept apart, so that no local of spindle_fiber_get() lives across getcontext(), which may return twice */
+static __attribute__((noinline)) int spindle_fiber_make(spindle_fiber_t *fiber, size_t page) /* {{{ */
+{
+	if (0 != getcontext(&fiber->ctx)) {
+		return -1;
+	}
+	fiber->ctx.uc_stack.ss_sp = (char *)fiber->stack + page;
+	fiber->ctx.uc_stack.ss_size = fiber->stack_size - page;
+	fiber->ctx.uc_link = NULL;
+	makecontext(&fiber->ctx, spindle_fiber_main, 0);
+	return 0;
+}
+/* }}} */
+
+/* takes a fiber off the worker's cache or the free list of the pool, or creates one */
+static spindle_fiber_t *spindle_fiber_get(spindle_worker_t *self) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+	spindle_fiber_t *fiber;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE), size;
+
+	fiber = self->fiber_cache;
+	if (fiber) {
+		self->fiber_cache = NULL;
+		return fiber;
+	}
+
+	if (__atomic_load_n(&pool->fiber_free, __ATOMIC_RELAXED)) {
+		spindle_spin_lock(&pool->fiber_lock);
+		fiber = pool->fiber_free;
+		if (fiber) {
+			__atomic_store_n(&pool->fiber_free, fiber->next, __ATOMIC_RELAXED);
+		}
+		spindle_spin_unlock(&pool->fiber_lock);
+		if (fiber) {
+			return fiber;
+		}
+	}
+
+	fiber = malloc(sizeof(spindle_fiber_t));
+	if (fiber == NULL) {
+		return NULL;
+	}
+
+	/* the lowest page stays inaccessible, so that an overflow crashes instead of corrupting the heap */
+	size = (pool->fiber_stack_size + page - 1) / page * page + page;
+	fiber->stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (fiber->stack == MAP_FAILED) {
+		free(fiber);
+		return NULL;
+	}
+	mprotect(fiber->stack, page, PROT_NONE);
+	fiber->stack_size = size;
+	fiber->pool = pool;
+
+	if (0 != spindle_fiber_make(fiber, page)) {
+		munmap(fiber->stack, size);
+		free(fiber);
+		return NULL;
+	}
+	return fiber;
+}
+/* }}} */
+
+static void spindle_fiber_free(spindle_fiber_t *fiber) /* {{{ */
+{
+	munmap(fiber->stack, fiber->stack_size);
+	free(fiber);
+}
+/* }}} */
+
+/* switches to the fiber until its job returns or it's suspended, then finishes the switch
+ * on the worker stack: recycles the fiber, or runs the action it was suspended with */
+static void spindle_fiber_run(spindle_worker_t *self, spindle_fiber_t *fiber) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+	void (*action)(spindle_fiber_t *);
+
+	fiber->worker = self;
+	spindle_current_fiber = fiber;
+	swapcontext(&self->fiber_ctx, &fiber->ctx);
+	spindle_current_fiber = NULL;
+
+	if (fiber->done) {
+		__atomic_sub_fetch(&pool->fibers_active, 1, __ATOMIC_SEQ_CST);
+		if (self->fiber_cache == NULL) {
+			self->fiber_cache = fiber;
+		} else {
+			spindle_spin_lock(&pool->fiber_lock);
+			fiber->next = pool->fiber_free;
+			__atomic_store_n(&pool->fiber_free, fiber, __ATOMIC_RELAXED);
+			spindle_spin_unlock(&pool->fiber_lock);
+		}
+		return;
+	}
+
+	/* the fiber may be resumed by somebody else as soon as the action has run */
+	action = self->fiber_action;
+	self->fiber_action = NULL;
+	if (action) {
+		action(fiber);
+	}
+}
+/* }}} */
+
+/* the job resuming a fiber that has called spindle_yield(), workers resume it directly (see spindle_worker_exec()),
+ * other threads that get the job hand the fiber over to the workers */
+static void spindle_fiber_resume_job(void *arg) /* {{{ */
+{
+	spindle_fiber_ready((spindle_fiber_t *)arg);
+}
+/* }}} */
+
+/* spindle_yield() action: queues the fiber behind the jobs waiting in the queue of the worker */
+static void spindle_fiber_requeue(spindle_fiber_t *fiber) /* {{{ */
+{
+	spindle_t *pool = fiber->pool;
+	spindle_worker_t *self = fiber->worker;
+	spindle_job_t job;
+
+	job.func = spindle_fiber_resume_job;
+	job.arg = fiber;
+	job.cleanup_func = NULL;
+	job.cleanup_arg = NULL;
+	job.barrier = NULL;
+	job.len = 0;
+	if (pool->timing) {
+		job.queued = spindle_clock_usec();
+	} else {
+		job.queued = (pool->priorities > 1) ? spindle_now_usec() : 0;
+	}
+
+	if (0 != queue_post_job(pool->nodes ? &pool->nodes[self->node].queue : &pool->job_queue[0], &job)) {
+		/* the queue is full, the fiber goes on before the jobs instead */
+		spindle_fiber_ready(fiber);
+		return;
+	}
+	spindle_wake_idle(pool);
+}
+/* }}} */
+
+/* takes a fiber off the ready list, NULL if there's none */
+static inline spindle_fiber_t *spindle_fiber_take_ready(spindle_t *pool) /* {{{ */
+{
+	spindle_fiber_t *fiber;
+
+	if (__atomic_load_n(&pool->nready, __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	spindle_spin_lock(&pool->fiber_lock);
+	fiber = pool->ready_head;
+	if (fiber) {
+		pool->ready_head = fiber->next;
+		if (pool->ready_head == NULL) {
+			pool->ready_tail = NULL;
+		}
+		__atomic_sub_fetch(&pool->nready, 1, __ATOMIC_SEQ_CST);
+	}
+	spindle_spin_unlock(&pool->fiber_lock);
+	return fiber;
+}
+/* }}} */
+#endif
+
+static void spindle_ticket_run(void *arg);
+
+/* runs the job itself, on a fiber of its own when the pool has them and it may suspend */
+static inline void spindle_worker_exec(spindle_worker_t *self, spindle_job_t *job) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_FIBERS
+	spindle_fiber_t *fiber;
+
+	/* the cancellation cleanup handlers are kept per thread, so these jobs can't move;
+	   a ticket carries the handler of its job, the wrapper is queued without one */
+	if (self->pool->fibers && job->cleanup_func == NULL && spindle_current_fiber == NULL
+			&& !(job->func == spindle_ticket_run && ((spindle_ticket_t *)job->arg)->cleanup_func)) {
+		fiber = spindle_fiber_get(self);
+		if (fiber) {
+			spindle_job_copy(&fiber->job, job);
+			fiber->done = 0;
+			__atomic_add_fetch(&self->pool->fibers_active, 1, __ATOMIC_SEQ_CST);
+			spindle_fiber_run(self, fiber);
+			return;
+		}
+		/* out of memory, the job can still run on the worker stack */
+	}
+#endif
+	spindle_run_job(job);
+}
+/* }}} */
+
+/* runs a job taken by the worker, either in its main loop or while it waits for a barrier */
+static inline void spindle_worker_run(spindle_worker_t *self, spindle_job_t *job) /* {{{ */
+{
+	unsigned long start, end;
+
+#ifdef SPINDLE_HAVE_FIBERS
+	if (job->func == spindle_fiber_resume_job) {
+		if (spindle_current_fiber == NULL) {
+			spindle_fiber_run(self, (spindle_fiber_t *)job->arg);
+		} else {
+			spindle_fiber_ready((spindle_fiber_t *)job->arg);
+		}
+		return;
+	}
+#endif
+
+	if (self->pool->timing) {
+		start = spindle_clock_usec();
+		if (job->queued && start > job->queued) {
+			spindle_stat_add(&self->stats.queue_wait[spindle_stats_bucket(start - job->queued)], 1);
+		}
+		spindle_worker_exec(self, job);
+		end = spindle_clock_usec();
+		spindle_stat_add(&self->stats.run_time[spindle_stats_bucket(end - start)], 1);
+	} else {
+		spindle_worker_exec(self, job);
+	}
+	spindle_stat_add(&self->stats.jobs, 1);
+}
+/* }}} */
+
+/* copies the thread attributes of attr, *out stays NULL if they're all defaults. Returns 0 or an errno */
+static int spindle_thread_attr_create(const spindle_attr_t *attr, spindle_thread_attr_t **out) /* {{{ */
+{
+	spindle_thread_attr_t *ta;
+	struct sched_param param;
+	int err = 0;
+
+	*out = NULL;
+	if (attr->stack_size < 0 || attr->guard_size < -1 || (attr->lock_stack != 0 && attr->lock_stack != 1) || (attr->pin != 0 && attr->pin != 1)) {
+		return EINVAL;
+	}
+	if (!attr->stack_size && attr->guard_size < 0 && !attr->lock_stack && attr->sched_policy == SCHED_OTHER && !attr->sched_priority && !attr->cpus && !attr->name) {
+		return 0;
+	}
+
+	ta = calloc(1, sizeof(spindle_thread_attr_t));
+	if (ta == NULL) {
+		return ENOMEM;
+	}
+	pthread_attr_init(&ta->attr);
+	if (attr->stack_size) {
+		err = pthread_attr_setstacksize(&ta->attr, attr->stack_size);
+	}
+	if (err == 0 && attr->guard_size >= 0) {
+		err = pthread_attr_setguardsize(&ta->attr, attr->guard_size);
+	}
+	if (err == 0 && (attr->sched_policy != SCHED_OTHER || attr->sched_priority)) {
+		/* not inherited, so that pthread_create() fails if the policy is refused */
+		param.sched_priority = attr->sched_priority;
+		err = pthread_attr_setinheritsched(&ta->attr, PTHREAD_EXPLICIT_SCHED);
+		if (err == 0) {
+			err = pthread_attr_setschedpolicy(&ta->attr, attr->sched_policy);
+		}
+		if (err == 0) {
+			err = pthread_attr_setschedparam(&ta->attr, &param);
+		}
+	}
+	if (err == 0 && attr->cpus) {
+#ifdef SPINDLE_HAVE_NUMA
+		ta->ncpus = spindle_parse_cpulist(attr->cpus, &ta->cpus);
+		if (ta->ncpus == 0) {
+			err = EINVAL;
+		}
+#else
+		err = ENOSYS;
+#endif
+	}
+	if (err != 0) {
+		pthread_attr_destroy(&ta->attr);
+		free(ta);
+		return err;
+	}
+
+	ta->lock_stack = attr->lock_stack;
+	ta->pin = attr->pin;
+	if (attr->name) {
+		strncpy(ta->name, attr->name, sizeof(ta->name) - 1);
+	}
+	*out = ta;
+	return 0;
+}
+/* }}} */
+
+static void spindle_thread_attr_free(spindle_thread_attr_t *ta) /* {{{ */
+{
+	if (ta) {
+		pthread_attr_destroy(&ta->attr);
+		free(ta);
+	}
+}
+/* }}} */
+
+#ifdef HAVE_PTHREAD_SETNAME_NP
+/* appends n bytes of s to the thread name of len bytes as far as they fit, returns the new length */
+static size_t spindle_name_append(char *name, size_t len, const char *s, size_t n) /* {{{ */
+{
+	if (n > SPINDLE_THREAD_NAME_MAX - len) {
+		n = SPINDLE_THREAD_NAME_MAX - len;
+	}
+	memcpy(name + len, s, n);
+	return len + n;
+}
+/* }}} */
+#endif
+
+/* applies the attributes a thread can only set up for itself, before the worker takes its first job */
+static void spindle_thread_setup(spindle_worker_t *self, spindle_thread_attr_t *ta) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_NUMA
+	cpu_set_t one;
+	int cpu, n;
+#endif
+#ifdef HAVE_PTHREAD_SETNAME_NP
+	char name[SPINDLE_THREAD_NAME_MAX + 1], id[12], *p;
+	size_t len;
+#endif
+#ifdef SPINDLE_HAVE_STACK_LOCK
+	pthread_attr_t attr;
+	void *stack;
+	size_t size;
+#endif
+
+#ifdef SPINDLE_HAVE_NUMA
+	if (ta->ncpus > 0 && ta->pin) {
+		/* the (id % ncpus)th CPU of the set */
+		for (cpu = 0, n = self->id % ta->ncpus; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &ta->cpus) && n-- == 0) {
+				break;
+			}
+		}
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &one);
+	} else if (ta->ncpus > 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &ta->cpus);
+	}
+#endif
+
+#ifdef HAVE_PTHREAD_SETNAME_NP
+	if (ta->name[0]) {
+		/* no printf(), the pattern comes from the user; whatever does not fit is cut off */
+		p = strstr(ta->name, "%d");
+		if (p) {
+			len = spindle_name_append(name, 0, ta->name, (size_t)(p - ta->name));
+			snprintf(id, sizeof(id), "%d", self->id);
+			len = spindle_name_append(name, len, id, strlen(id));
+			len = spindle_name_append(name, len, p + 2, strlen(p + 2));
+		} else {
+			len = spindle_name_append(name, 0, ta->name, strlen(ta->name));
+		}
+		name[len] = '\0';
+		pthread_setname_np(pthread_self(), name);
+	}
+#endif
+
+#ifdef SPINDLE_HAVE_STACK_LOCK
+	if (ta->lock_stack && 0 == pthread_getattr_np(pthread_self(), &attr)) {
+		if (0 == pthread_attr_getstack(&attr, &stack, &size)) {
+# ifdef MADV_HUGEPAGE
+			madvise(stack, size, MADV_HUGEPAGE);
+# endif
+			if (0 != mlock(stack, size)) {
+				TP_DEBUG(self->pool, " --- Thread[%d]: can't lock the stack: %s\n", self->id, strerror(errno));
+			}
+		}
+		pthread_attr_destroy(&attr);
+	}
+#endif
+}
+/* }}} */
+
+static void *th_do_work(void *data) /* {{{ */
+{
+	spindle_worker_t *self = (spindle_worker_t *)data;
+	spindle_t *pool = self->pool;
+#ifdef SPINDLE_DEBUG
+	int myid = self->id;
+#endif
+
+	/* When we get a posted job, we copy it here */
+	spindle_job_t job;
+	spindle_t *lane;
+	int retired = 0;
+#ifdef SPINDLE_HAVE_FIBERS
+	spindle_fiber_t *fiber;
+#endif
+
+	TP_DEBUG(pool, " >>> Thread[%d] starting.\n", myid);
+
+	spindle_current_worker = self;
+	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+	__atomic_store_n(&self->stats.started, spindle_clock_usec(), __ATOMIC_RELAXED);
+#ifdef SPINDLE_HAVE_NUMA
+	if (pool->nodes) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pool->nodes[self->node].cpus);
+	}
+#endif
+	if (pool->thread_attr) {
+		spindle_thread_setup(self, pool->thread_attr);
+	}
+
+	/* Main loop: wait for job posting, do job(s) ... forever */
+	for( ; ; ) {
+
+		if (__atomic_load_n(&pool->size, __ATOMIC_RELAXED) > __atomic_load_n(&pool->target, __ATOMIC_RELAXED) && spindle_worker_retire(self, 0)) {
+			retired = 1;
+			break;
+		}
+
+#ifdef SPINDLE_HAVE_FIBERS
+		/* the fibers that can go on come before new jobs, so that they don't pile up */
+		if (!__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED) && (fiber = spindle_fiber_take_ready(pool)) != NULL) {
+			spindle_fiber_run(self, fiber);
+			continue;
+		}
+#endif
+
+		if (__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED) || !spindle_get_job(self, &job)) {
+			/* spindle_destroy() waits for the queues to be empty */
+			if (__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED)) {
+				break;
+			}
+			/* nothing of our own, help a lane out: on the worker stack, the job belongs to the lane */
+			if (!__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED) && (lane = spindle_spill_job(pool, &job)) != NULL) {
+				spindle_run_job(&job);
+				spindle_spill_done(lane);
+				spindle_stat_add(&self->stats.jobs, 1);
+				continue;
+			}
+			if (spindle_park(self) == ETIMEDOUT && spindle_worker_retire(self, 1)) {
+				retired = 1;
+				break;
+			}
+			continue;
+		}
+
+		/* Run the job we've taken */
+		TP_DEBUG(pool, " <<< Thread[%d] taking job.\n", myid);
+		spindle_worker_run(self, &job);
+		TP_DEBUG(pool, " >>> Thread[%d] JOB DONE!\n", myid);
+	}
+
+	/* If we get here, the pool is being destroyed or we've retired */
+	pthread_mutex_lock(&pool->mutex);
+	if (!retired) {
+		__atomic_store_n(&pool->size, pool->size - 1, __ATOMIC_RELAXED);
+	}
+	--pool->live;
+	__atomic_store_n(&self->state, SPINDLE_WORKER_EXITED, __ATOMIC_RELAXED);
+	spindle_stat_add(&self->stats.alive_usec, spindle_clock_usec() - self->stats.started);
+	__atomic_store_n(&self->stats.started, 0, __ATOMIC_RELAXED);
+
+	TP_DEBUG(pool, " <<< Thread[%d] exiting.\n", myid);
+	pthread_mutex_unlock(&pool->mutex);
+
+	spindle_current_worker = NULL;
+	return NULL;
+}
+/* }}} */
+
+spindle_t *spindle_create(int num_threads_in_pool) /* {{{ */
+{
+	return spindle_create_ex(num_threads_in_pool, 0);
+}
+/* }}} */
+
+spindle_t *spindle_create_ex(int num_threads_in_pool, int max_queue_size) /* {{{ */
+{
+	return spindle_create_with_attr(num_threads_in_pool, max_queue_size, NULL);
+}
+/* }}} */
+
+void spindle_attr_init(spindle_attr_t *attr) /* {{{ */
+{
+	memset(attr, 0, sizeof(spindle_attr_t));
+	attr->scheduler = SPINDLE_SCHED_SHARED;
+	attr->queue_order = SPINDLE_QUEUE_FIFO;
+	attr->priorities = 1;
+	attr->aging_usec = SPINDLE_DEFAULT_AGING_USEC;
+	attr->linger_usec = SPINDLE_DEFAULT_LINGER_USEC;
+	attr->spin_count = SPINDLE_DEFAULT_SPIN_COUNT;
+	attr->yield_count = SPINDLE_DEFAULT_YIELD_COUNT;
+	attr->help_wait = 0;
+	attr->fiber_stack_size = SPINDLE_DEFAULT_FIBER_STACK_SIZE;
+	attr->guard_size = -1;
+	attr->sched_policy = SCHED_OTHER;
+}
+/* }}} */
+
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+/* CPU time consumed by the worker in usec, (unsigned long)-1 on failure */
+static inline unsigned long spindle_worker_cpu_usec(spindle_worker_t *worker) /* {{{ */
+{
+	struct timespec ts;
+
+	if (0 != clock_gettime(worker->cpu_clock, &ts)) {
+		return (unsigned long)-1;
+	}
+	return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+/* }}} */
+#endif
+
+/* starts a worker in the first free slot, must be called with the pool mutex held */
+static int spindle_spawn_worker(spindle_t *pool) /* {{{ */
+{
+	spindle_worker_t *worker;
+	int i, err;
+
+	for (i = 0; i < SPINDLE_MAX_IN_POOL; i++) {
+		if (pool->workers[i] == NULL || pool->workers[i]->state != SPINDLE_WORKER_RUNNING) {
+			break;
+		}
+	}
+
+	if (i == SPINDLE_MAX_IN_POOL) {
+		return EAGAIN;
+	}
+
+	worker = pool->workers[i];
+	if (worker == NULL) {
+#ifdef SPINDLE_HAVE_NUMA
+		cpu_set_t saved;
+		int bound = spindle_node_enter(pool, i % pool->nnodes, &saved);
+#endif
+		/* workers are cache line aligned, so that the deques don't share lines */
+		err = posix_memalign((void **)&worker, SPINDLE_CACHELINE_SIZE, sizeof(spindle_worker_t));
+		if (err == 0) {
+			memset(worker, 0, sizeof(spindle_worker_t));
+			if (0 != queue_init(&worker->mailbox, SPINDLE_MAILBOX_SIZE, SPINDLE_QUEUE_FIFO)) {
+				free(worker);
+				err = ENOMEM;
+			} else if (pool->scheduler == SPINDLE_SCHED_STEALING
+					&& 0 != posix_memalign((void **)&worker->deque.jobs, SPINDLE_CACHELINE_SIZE, SPINDLE_DEQUE_SIZE * sizeof(spindle_job_t))) {
+				queue_free(&worker->mailbox);
+				free(worker);
+				err = ENOMEM;
+			}
+		}
+#ifdef SPINDLE_HAVE_NUMA
+		if (bound) {
+			spindle_node_leave(&saved);
+		}
+#endif
+		if (err != 0) {
+			return ENOMEM;
+		}
+		worker->pool = pool;
+		worker->id = i;
+		worker->node = i % pool->nnodes;
+		worker->seed = i + 1;
+		worker->parked_at = -1;
+
+		/* thieves read the slots without the lock */
+		__atomic_store_n(&pool->workers[i], worker, __ATOMIC_RELEASE);
+		__atomic_store_n(&pool->slots, i + 1, __ATOMIC_RELEASE);
+	} else if (worker->state == SPINDLE_WORKER_EXITED) {
+		/* it has already left th_do_work(), so this doesn't take long */
+		pthread_join(worker->thread, NULL);
+		worker->state = SPINDLE_WORKER_FREE;
+	}
+
+	worker->state = SPINDLE_WORKER_RUNNING;
+	err = pthread_create(&worker->thread, pool->thread_attr ? &pool->thread_attr->attr : NULL, th_do_work, (void *)worker);
+	if (err != 0) {
+		worker->state = SPINDLE_WORKER_FREE;
+		return err;
+	}
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+	pthread_getcpuclockid(worker->thread, &worker->cpu_clock);
+	worker->cpu_usec = 0;
+#endif
+
+	__atomic_store_n(&pool->size, pool->size + 1, __ATOMIC_RELAXED);
+	pool->live++;
+	TP_DEBUG(pool, " <<< Thread[%d] started, %d workers.\n", i, pool->size);
+	return 0;
+}
+/* }}} */
+
+/* starts or retires workers to have n of them, must be called with the pool mutex held */
+static int spindle_set_target(spindle_t *pool, int n) /* {{{ */
+{
+	int err = 0;
+
+	__atomic_store_n(&pool->target, n, __ATOMIC_RELAXED);
+	while (pool->size < n) {
+		err = spindle_spawn_worker(pool);
+		if (err != 0) {
+			__atomic_store_n(&pool->target, pool->size, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	if (pool->size > n) {
+		/* idle workers retire right away, busy ones after their current job */
+		spindle_wake_all(pool);
+	}
+	return err;
+}
+/* }}} */
+
+/* the controller of an elastic pool: grows the pool while jobs keep waiting and nobody is idle.
+ * If the workers burn less than half of the time on CPU, they are mostly blocked, so the pool
+ * grows by the number of sleeping workers at once. If they keep all the CPUs busy, the pool
+ * shrinks back to the number of CPUs. Otherwise it moves one worker at a time
+ * and reverses the direction once the throughput drops (hill climbing).
+ * Shrinking after the load is gone is up to the workers themselves, see spindle_park(). */
+static void *spindle_control(void *data) /* {{{ */
+{
+	spindle_t *pool = (spindle_t *)data;
+	spindle_worker_t *worker;
+	struct timespec abstime;
+	unsigned long now, then, interval, done, last_done = 0, jobs, cpu;
+	double tput, last_tput = 0;
+	int i, n, cpus, cpu_ok, busy_samples = 0, dir = 1;
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+	unsigned long usec;
+#endif
+
+	/* the workers can't burn more CPU time than there is */
+	cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	then = spindle_now_usec();
+	while (!pool->stopping) {
+		spindle_abstime(&abstime, SPINDLE_CONTROL_INTERVAL_USEC);
+		pthread_cond_timedwait(&pool->control, &pool->mutex, &abstime);
+		if (pool->stopping) {
+			break;
+		}
+
+		now = spindle_now_usec();
+		interval = now - then;
+		if (now <= then) {
+			continue;
+		}
+		then = now;
+
+		done = 0;
+		cpu = 0;
+		cpu_ok = 0;
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+		cpu_ok = 1;
+#endif
+		for (i = 0; i < pool->slots; i++) {
+			worker = pool->workers[i];
+			done += __atomic_load_n(&worker->stats.jobs, __ATOMIC_RELAXED);
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+			if (worker->state == SPINDLE_WORKER_RUNNING) {
+				usec = spindle_worker_cpu_usec(worker);
+				if (usec == (unsigned long)-1) {
+					cpu_ok = 0;
+				} else {
+					if (usec > worker->cpu_usec) {
+						cpu += usec - worker->cpu_usec;
+					}
+					worker->cpu_usec = usec;
+				}
+			}
+#endif
+		}
+		jobs = done - last_done;
+		last_done = done;
+
+		if (spindle_queue_get_posted(pool) <= pool->grow_threshold || __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0 || pool->size != pool->target) {
+			busy_samples = 0;
+			last_tput = 0;
+			dir = 1;
+			continue;
+		}
+
+		if (++busy_samples < SPINDLE_GROW_SAMPLES) {
+			continue;
+		}
+
+		n = pool->size;
+		if (cpu_ok && cpu * 2 < (n < cpus ? n : cpus) * interval) {
+			/* most of the workers are blocked, add as many as are sleeping */
+			n += n - (int)(cpu / interval);
+			last_tput = 0;
+			dir = 1;
+		} else if (cpu_ok && cpu * 10 >= (unsigned long)cpus * interval * 9) {
+			/* the CPUs are saturated, more workers won't help */
+			if (n > cpus) {
+				n--;
+			}
+			last_tput = 0;
+			dir = 1;
+		} else if (jobs > 0) {
+			tput = (double)jobs / interval;
+			if (last_tput > 0 && tput < last_tput * 0.95) {
+				dir = -dir;
+			}
+			last_tput = tput;
+			n += dir;
+		}
+
+		if (n > pool->max_size) {
+			n = pool->max_size;
+			dir = -1;
+		} else if (n < pool->min_size) {
+			n = pool->min_size;
+			dir = 1;
+		}
+
+		if (n != pool->size) {
+			TP_DEBUG(pool, " <<< Controller: %d -> %d workers.\n", pool->size, n);
+			spindle_set_target(pool, n);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+/* }}} */
+
+spindle_t *spindle_create_with_attr(int num_threads_in_pool, int max_queue_size, const spindle_attr_t *attr) /* {{{ */
+{
+	spindle_t *pool;
+	spindle_attr_t default_attr;
+	int min_size, max_size, err;
+
+	if (!attr) {
+		spindle_attr_init(&default_attr);
+		attr = &default_attr;
+	}
+
+	min_size = attr->min_threads ? attr->min_threads : num_threads_in_pool;
+	max_size = attr->max_threads ? attr->max_threads : num_threads_in_pool;
+	if (min_size <= 0 || min_size > num_threads_in_pool || num_threads_in_pool > max_size || max_size > SPINDLE_MAX_IN_POOL) {
+		return NULL;
+	}
+
+	if (attr->linger_usec < 0 || attr->grow_threshold < 0) {
+		return NULL;
+	}
+
+	if (attr->scheduler != SPINDLE_SCHED_SHARED && attr->scheduler != SPINDLE_SCHED_STEALING) {
+		return NULL;
+	}
+
+	if (attr->queue_order != SPINDLE_QUEUE_FIFO && attr->queue_order != SPINDLE_QUEUE_LIFO) {
+		return NULL;
+	}
+
+	if (attr->priorities < 1 || attr->priorities > SPINDLE_MAX_PRIORITIES || attr->aging_usec < 0) {
+		return NULL;
+	}
+
+	if (attr->numa != 0 && attr->numa != 1) {
+		return NULL;
+	}
+
+	if (attr->timing != 0 && attr->timing != 1) {
+		return NULL;
+	}
+
+	if (attr->spin_count < 0 || attr->yield_count < 0) {
+		return NULL;
+	}
+
+	if (attr->help_wait != 0 && attr->help_wait != 1) {
+		return NULL;
+	}
+
+	if (attr->fibers != 0 && attr->fibers != 1) {
+		return NULL;
+	}
+#ifndef SPINDLE_HAVE_FIBERS
+	if (attr->fibers) {
+		return NULL;
+	}
+#endif
+
+	if (attr->fiber_stack_size < 0) {
+		return NULL;
+	}
+
+	if (attr->spill != 0 && attr->spill != 1) {
+		return NULL;
+	}
+
+	pool = (spindle_t *) malloc(sizeof(spindle_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	err = spindle_thread_attr_create(attr, &pool->thread_attr);
+	if (err != 0) {
+		free(pool);
+		errno = err;
+		return NULL;
+	}
+
+	pthread_mutex_init(&(pool->mutex), NULL);
+	pthread_cond_init(&(pool->job_taken), NULL);
+	pthread_cond_init(&(pool->control), NULL);
+	pthread_cond_init(&(pool->quiet), NULL);
+	pool->size = 0;
+	pool->target = 0;
+	pool->slots = 0;
+	pool->min_size = min_size;
+	pool->max_size = max_size;
+	pool->linger = attr->linger_usec;
+	pool->grow_threshold = attr->grow_threshold;
+	pool->stopping = 0;
+	pool->suspended = 0;
+	pool->draining = 0;
+	pool->foreign = 0;
+	pool->completion_fd = -1;
+	pool->completion_wfd = -1;
+	pool->completion_signalled = 0;
+	pool->reap_lock = 0;
+	pool->completed = NULL;
+	pool->reaped = NULL;
+	pool->wheel = NULL;
+	pool->strands = NULL;
+	pool->ticket_slab = NULL;
+	pool->ntenants = 0;
+	pool->tenant_vtime = 0;
+	pool->fibers = attr->fibers;
+	pool->fiber_stack_size = attr->fiber_stack_size ? attr->fiber_stack_size : SPINDLE_DEFAULT_FIBER_STACK_SIZE;
+	pool->fiber_lock = 0;
+	pool->fiber_free = NULL;
+	pool->ready_head = NULL;
+	pool->ready_tail = NULL;
+	pool->nready = 0;
+	pool->fibers_active = 0;
+	pool->parent = NULL;
+	memset(pool->lanes, 0, sizeof(pool->lanes));
+	pool->lanes[0] = pool;
+	pool->nlanes = 1;
+	pool->spill = 0;
+	pool->spill_lanes = 0;
+	pool->scheduler = attr->scheduler;
+	pool->idle = 0;
+	pool->blocked = 0;
+	pool->slots_freed = 0;
+	pool->spinning = 0;
+	pool->skipped = 0;
+	pool->parked_lock = 0;
+	pool->nparked = 0;
+	pool->parked = NULL;
+	pool->yield_count = attr->yield_count;
+	pool->help_wait = attr->help_wait;
+	/* spinning on a single CPU only keeps the dispatcher from running */
+	pool->spin_count = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? attr->spin_count : 0;
+	pool->max_spinning = (pool->spin_count + pool->yield_count > 0) ? (int)(sysconf(_SC_NPROCESSORS_ONLN) + 1) / 2 : 0;
+	pool->priorities = attr->priorities;
+	pool->aging = attr->aging_usec;
+	pool->timing = attr->timing;
+	pool->blocked_waits = 0;
+	pool->blocked_usec = 0;
+	pool->expired = 0;
+	pool->cancelled = 0;
+	pool->job_queue = spindle_queues_create(pool->priorities, max_queue_size, attr->queue_order);
+	if (pool->job_queue == NULL) {
+		spindle_thread_attr_free(pool->thread_attr);
+		free(pool);
+		return NULL;
+	}
+#ifdef SPINDLE_DEBUG
+	gettimeofday(&pool->created, NULL);
+#endif
+
+	pool->nnodes = 1;
+	pool->nodes = NULL;
+	pool->cpu_node = NULL;
+	if (attr->numa && 0 != spindle_nodes_create(pool, max_queue_size, attr->queue_order)) {
+		spindle_queues_destroy(pool->job_queue, pool->priorities);
+		spindle_thread_attr_free(pool->thread_attr);
+		free(pool);
+		return NULL;
+	}
+
+	if (0 != posix_memalign((void **)&pool->future_slab, SPINDLE_CACHELINE_SIZE, sizeof(spindle_slab_t))) {
+		spindle_nodes_destroy(pool);
+		spindle_queues_destroy(pool->job_queue, pool->priorities);
+		spindle_thread_attr_free(pool->thread_attr);
+		free(pool);
+		return NULL;
+	}
+	spindle_slab_init(pool->future_slab, sizeof(spindle_future_t));
+
+	pool->workers = calloc(SPINDLE_MAX_IN_POOL, sizeof(spindle_worker_t *));
+	pool->parked = calloc(SPINDLE_MAX_IN_POOL, sizeof(spindle_worker_t *));
+	if (pool->workers == NULL || pool->parked == NULL) {
+		free(pool->workers);
+		free(pool->parked);
+		spindle_slab_destroy(pool->future_slab);
+		free(pool->future_slab);
+		spindle_nodes_destroy(pool);
+		spindle_queues_destroy(pool->job_queue, pool->priorities);
+		spindle_thread_attr_free(pool->thread_attr);
+		free(pool);
+		return NULL;
+	}
+
+	pool->live = 0;
+	pthread_mutex_lock(&pool->mutex);
+	err = spindle_set_target(pool, num_threads_in_pool);
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (err == 0 && pool->max_size > pool->min_size) {
+		err = pthread_create(&pool->controller, NULL, spindle_control, (void *)pool);
+	}
+
+	if (err != 0) {
+		/* let the workers that have started exit the normal way,
+		   there is no controller for spindle_destroy() to stop */
+		pool->max_size = pool->min_size;
+		spindle_destroy(pool);
+		errno = err;
+		return NULL;
+	}
+
+	TP_DEBUG(pool, " <<< Threadpool created with %d threads.\n", num_threads_in_pool);
+
+	return (spindle_t *)pool;
+}
+/* }}} */
+
+int spindle_resize(spindle_t *pool, int n) /* {{{ */
+{
+	int err;
+
+	if (n < 1 || n > SPINDLE_MAX_IN_POOL) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->max_size > pool->min_size) {
+		if (n < pool->min_size) {
+			n = pool->min_size;
+		} else if (n > pool->max_size) {
+			n = pool->max_size;
+		}
+	} else {
+		pool->min_size = n;
+		pool->max_size = n;
+	}
+	err = spindle_set_target(pool, n);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return err;
+}
+/* }}} */
+
+/* blocks until there is a free slot in the queue or until abstime (may be NULL), returns ETIMEDOUT on timeout */
+static int spindle_wait_for_slot(spindle_t *pool, spindle_queue_head_t *queue, const struct timespec *abstime) /* {{{ */
+{
+	unsigned long since;
+	int ret = 0;
+
+	TP_DEBUG(pool, " <<< Dispatcher: job queue full, waiting on 'taken'.\n");
+
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *) &pool->mutex);
+
+	/* same handshake as in spindle_park(), but with the roles reversed */
+	__atomic_add_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!queue_can_accept_order(queue)) {
+		since = spindle_clock_usec();
+		if (abstime) {
+			ret = pthread_cond_timedwait(&pool->job_taken, &pool->mutex, abstime);
+		} else {
+			pthread_cond_wait(&pool->job_taken, &pool->mutex);
+		}
+		__atomic_add_fetch(&pool->blocked_waits, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pool->blocked_usec, spindle_clock_usec() - since, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+
+	pthread_cleanup_pop(1);
+	return ret;
+}
+/* }}} */
+
+/* posts a job to the shared queue; while the queue is full either waits (until abstime, if it's not NULL)
+ * or fails right away. Returns 0, EAGAIN or ETIMEDOUT */
+static int spindle_post_job(spindle_t *pool, spindle_queue_head_t *queue, const spindle_job_t *job, int wait, const struct timespec *abstime) /* {{{ */
+{
+	int timedout = 0;
+
+	while (0 != queue_post_job(queue, job)) {
+		if (!wait) {
+			return EAGAIN;
+		}
+		if (timedout) {
+			return ETIMEDOUT;
+		}
+		/* one more try after the timeout, a slot may have been freed in the meantime */
+		timedout = (spindle_wait_for_slot(pool, queue, abstime) == ETIMEDOUT);
+	}
+
+	TP_DEBUG(pool, " <<< Dispatcher: job posted\n");
+	spindle_wake_idle(pool);
+	return 0;
+}
+/* }}} */
+
+/* the queue of the highest priority level for the calling thread:
+ * in NUMA-aware pools that's the queue of the node it's running on */
+static inline spindle_queue_head_t *spindle_local_queue(spindle_t *pool, spindle_worker_t *self) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_NUMA
+	int cpu;
+
+	if (pool->nodes) {
+		if (self && self->pool == pool) {
+			return &pool->nodes[self->node].queue;
+		}
+		cpu = sched_getcpu();
+		if (cpu >= 0 && cpu < CPU_SETSIZE && pool->cpu_node[cpu] >= 0) {
+			return &pool->nodes[pool->cpu_node[cpu]].queue;
+		}
+	}
+#endif
+	return &pool->job_queue[0];
+}
+/* }}} */
+
+#ifdef SPINDLE_HAVE_FIBERS
+/* spindle_worker_post() for a fiber: it doesn't run other jobs, as it might go on on another thread
+ * after any of them, but sleeps until the queue takes jobs again, and the worker is free meanwhile.
+ * blocked is the counter the wakers look at, that of the pool or of the tenant that owns the queue */
+static void spindle_fiber_post(spindle_t *pool, spindle_queue_head_t *queue, volatile int *blocked, const spindle_job_t *job) /* {{{ */
+{
+	int seq;
+
+	for ( ; ; ) {
+		seq = __atomic_load_n(&pool->slots_freed, __ATOMIC_SEQ_CST);
+		if (0 == queue_post_job(queue, job)) {
+			break;
+		}
+		/* same handshake as in spindle_wait_for_slot() */
+		__atomic_add_fetch(blocked, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!queue_can_accept_order(queue)) {
+			spindle_fiber_wait(spindle_fiber_self(), &pool->slots_freed, seq);
+		}
+		__atomic_sub_fetch(blocked, 1, __ATOMIC_SEQ_CST);
+	}
+	spindle_wake_idle(pool);
+}
+/* }}} */
+#endif
+
+/* posts a job of a worker to a full queue of its own pool without a time limit. The worker must not block
+ * on its own pool: if every worker did, nobody would be left to free a slot. So it runs the queued jobs
+ * itself, like a worker waiting for a barrier does, until the new job fits in behind them; only when
+ * there's nothing it may take does the new job run right here. A fiber just steps aside, see spindle_fiber_post() */
+static void spindle_worker_post(spindle_worker_t *self, spindle_queue_head_t *queue, volatile int *blocked, spindle_job_t *job) /* {{{ */
+{
+	spindle_t *pool = self->pool;
+	spindle_job_t other;
+
+#ifdef SPINDLE_HAVE_FIBERS
+	if (spindle_fiber_self()) {
+		spindle_fiber_post(pool, queue, blocked, job);
+		return;
+	}
+#endif
+
+	while (0 != queue_post_job(queue, job)) {
+		if (__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED) || !spindle_get_job(self, &other)) {
+			TP_DEBUG(pool, " <<< Dispatcher[%d]: job queue full, running the job inline\n", self->id);
+			spindle_worker_run(self, job);
+			return;
+		}
+		spindle_worker_run(self, &other);
+	}
+	spindle_wake_idle(pool);
+}
+/* }}} */
+
+/* common part of the dispatch functions, see spindle_post_job() for wait and abstime;
+ * node is the NUMA node to post the job to, -1 means the local one */
+static int spindle_dispatch_job(spindle_t *pool, int prio, int node, spindle_job_t *job, int wait, const struct timespec *abstime) /* {{{ */
+{
+	spindle_worker_t *self = spindle_current_worker;
+	spindle_queue_head_t *queue;
+	int err;
+
+	if (prio < 0) {
+		prio = 0;
+	} else if (prio >= pool->priorities) {
+		prio = pool->priorities - 1;
+	}
+
+	if (prio > 0) {
+		queue = &pool->job_queue[prio];
+	} else if (node >= 0 && pool->nodes) {
+		queue = &pool->nodes[node].queue;
+	} else if (node >= 0) {
+		queue = &pool->job_queue[0];
+	} else {
+		queue = spindle_local_queue(pool, self);
+	}
+	if (pool->timing) {
+		job->queued = spindle_clock_usec();
+	} else {
+		job->queued = (pool->priorities > 1) ? spindle_now_usec() : 0;
+	}
+
+	if (job->barrier) {
+		spindle_barrier_add(job->barrier, 1);
+	}
+
+	/* the deques are not prioritized, their jobs are always taken first */
+	if (self && self->pool == pool && pool->scheduler == SPINDLE_SCHED_STEALING && prio == 0 && node < 0) {
+		if (0 == deque_push(&self->deque, job)) {
+			TP_DEBUG(pool, " <<< Dispatcher[%d]: job pushed to the local deque\n", self->id);
+			spindle_wake_idle(pool);
+			return 0;
+		}
+		/* the deque is full, fall back to the shared queue */
+	}
+
+	if (self && self->pool == pool && wait && abstime == NULL) {
+		spindle_worker_post(self, queue, &pool->blocked, job);
+		return 0;
+	}
+
+	err = spindle_post_job(pool, queue, job, wait, abstime);
+	if (err != 0 && job->barrier) {
+		/* the job is not going to run */
+		spindle_barrier_signal(job->barrier);
+	}
+	return err;
+}
+/* }}} */
+
+void spindle_dispatch_prio_with_cleanup(spindle_t *pool, int prio, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg) /* {{{ */
+{
+	spindle_job_t job;
+
+	job.func = dispatch_to_here;
+	job.arg = arg;
+	job.cleanup_func = cleaner_func;
+	job.cleanup_arg = cleaner_arg;
+	job.barrier = barrier;
+	job.len = 0;
+
+	spindle_dispatch_job(pool, prio, -1, &job, 1, NULL);
+}
+/* }}} */
+
+int spindle_dispatch_copy(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, const void *data, size_t len) /* {{{ */
+{
+	spindle_job_t job;
+
+	if (len > SPINDLE_INLINE_ARG_SIZE) {
+		return EINVAL;
+	}
+
+	job.func = dispatch_to_here;
+	job.arg = NULL;
+	job.cleanup_func = NULL;
+	job.cleanup_arg = NULL;
+	job.barrier = barrier;
+	job.len = (int)len;
+	memcpy(job.data, data, len);
+
+	spindle_dispatch_job(pool, 0, -1, &job, 1, NULL);
+	return 0;
+}
+/* }}} */
+
+int spindle_try_dispatch(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg) /* {{{ */
+{
+	spindle_job_t job = {0};
+
+	if (__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED)) {
+		return ESHUTDOWN;
+	}
+
+	job.func = dispatch_to_here;
+	job.arg = arg;
+	job.barrier = barrier;
+
+	return spindle_dispatch_job(pool, 0, -1, &job, 0, NULL);
+}
+/* }}} */
+
+int spindle_dispatch_timed(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, const struct timespec *abstime) /* {{{ */
+{
+	spindle_job_t job = {0};
+
+	if (__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED)) {
+		return ESHUTDOWN;
+	}
+
+	job.func = dispatch_to_here;
+	job.arg = arg;
+	job.barrier = barrier;
+
+	return spindle_dispatch_job(pool, 0, -1, &job, 1, abstime);
+}
+/* }}} */
+
+int spindle_dispatch_on_node(spindle_t *pool, int node, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg) /* {{{ */
+{
+	spindle_job_t job = {0};
+
+	if (node < 0 || node >= pool->nnodes) {
+		return EINVAL;
+	}
+
+	job.func = dispatch_to_here;
+	job.arg = arg;
+	job.barrier = barrier;
+
+	return spindle_dispatch_job(pool, 0, node, &job, 1, NULL);
+}
+/* }}} */
+
+int spindle_dispatch_to_worker(spindle_t *pool, int worker_id, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg) /* {{{ */
+{
+	spindle_worker_t *worker = NULL;
+	spindle_job_t job = {0};
+	int node = -1;
+
+	if (worker_id < 0 || worker_id >= SPINDLE_MAX_IN_POOL) {
+		return EINVAL;
+	}
+
+	job.func = dispatch_to_here;
+	job.arg = arg;
+	job.barrier = barrier;
+
+	/* under the mutex the worker can't retire before it sees the job, see spindle_worker_retire() */
+	pthread_mutex_lock(&pool->mutex);
+	if (worker_id < pool->slots) {
+		worker = pool->workers[worker_id];
+	}
+	if (worker && worker->state == SPINDLE_WORKER_RUNNING) {
+		if (barrier) {
+			spindle_barrier_add(barrier, 1);
+		}
+		if (0 == queue_post_job(&worker->mailbox, &job)) {
+			spindle_wake_worker(pool, worker);
+			pthread_mutex_unlock(&pool->mutex);
+			return 0;
+		}
+		if (barrier) {
+			spindle_barrier_signal(barrier);
+		}
+		node = worker->node;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	/* it's only a hint: the worker is gone or has too much to do already */
+	return spindle_dispatch_job(pool, 0, node, &job, 1, NULL);
+}
+/* }}} */
+
+int spindle_lane_create(spindle_t *pool, int num_threads, int max_queue_size, const spindle_attr_t *attr) /* {{{ */
+{
+	spindle_t *lane;
+	int n;
+
+	if (pool->parent) {
+		return -1;
+	}
+
+	lane = spindle_create_with_attr(num_threads, max_queue_size, attr);
+	if (lane == NULL) {
+		return -1;
+	}
+	lane->parent = pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	n = pool->nlanes;
+	if (n == SPINDLE_MAX_LANES || pool->stopping) {
+		pthread_mutex_unlock(&pool->mutex);
+		spindle_destroy(lane);
+		return -1;
+	}
+	pool->lanes[n] = lane;
+	__atomic_store_n(&pool->nlanes, n + 1, __ATOMIC_RELEASE);
+	if (attr && attr->spill) {
+		__atomic_add_fetch(&pool->spill_lanes, 1, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&lane->spill, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	TP_DEBUG(pool, " <<< Lane %d created with %d threads.\n", n, num_threads);
+	return n;
+}
+/* }}} */
+
+spindle_t *spindle_lane_get(spindle_t *pool, int lane) /* {{{ */
+{
+	if (lane < 0 || lane >= __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return pool->lanes[lane];
+}
+/* }}} */
+
+int spindle_dispatch_lane(spindle_t *pool, int lane, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg) /* {{{ */
+{
+	spindle_t *target = spindle_lane_get(pool, lane);
+
+	if (target == NULL) {
+		return EINVAL;
+	}
+
+	spindle_dispatch_prio_with_cleanup(target, 0, barrier, dispatch_to_here, arg, NULL, NULL);
+	return 0;
+}
+/* }}} */
+
+static spindle_tenant_t *spindle_tenant_alloc(const char *name, int weight) /* {{{ */
+{
+	spindle_tenant_t *tenant;
+
+	if (0 != posix_memalign((void **)&tenant, SPINDLE_CACHELINE_SIZE, sizeof(spindle_tenant_t))) {
+		return NULL;
+	}
+	memset(tenant, 0, sizeof(spindle_tenant_t));
+	strncpy(tenant->name, name ? name : "", SPINDLE_TENANT_NAME_SIZE - 1);
+	tenant->weight = weight;
+	tenant->stride = SPINDLE_STRIDE / weight;
+	pthread_cond_init(&tenant->taken, NULL);
+	return tenant;
+}
+/* }}} */
+
+static void spindle_tenant_free(spindle_tenant_t *tenant, int queue) /* {{{ */
+{
+	if (queue) {
+		queue_free(&tenant->queue);
+	}
+	pthread_cond_destroy(&tenant->taken);
+	free(tenant);
+}
+/* }}} */
+
+/* the jobs still queued are dropped */
+static void spindle_tenants_destroy(spindle_t *pool) /* {{{ */
+{
+	int i;
+
+	for (i = 0; i < pool->ntenants; i++) {
+		spindle_tenant_free(pool->tenants[i], i > 0);
+		pool->tenants[i] = NULL;
+	}
+	pool->ntenants = 0;
+}
+/* }}} */
+
+int spindle_tenant_create(spindle_t *pool, const char *name, int weight, int max_queue_size) /* {{{ */
+{
+	spindle_tenant_t *tenant, *own = NULL;
+	int n, err = 0;
+
+	if (weight < 1 || weight > SPINDLE_MAX_WEIGHT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	n = pool->ntenants;
+	if (n == SPINDLE_MAX_TENANTS) {
+		err = EAGAIN;
+	} else if (n == 0 && NULL == (own = spindle_tenant_alloc("default", 1))) {
+		err = ENOMEM;
+	} else if (NULL == (tenant = spindle_tenant_alloc(name, weight))) {
+		err = ENOMEM;
+	} else if (0 != queue_init(&tenant->queue, max_queue_size, pool->job_queue[0].order)) {
+		spindle_tenant_free(tenant, 0);
+		err = ENOMEM;
+	}
+	if (err != 0) {
+		if (own) {
+			spindle_tenant_free(own, 0);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+		errno = err;
+		return -1;
+	}
+
+	if (n == 0) {
+		pool->tenants[n++] = own;
+	}
+	/* a newcomer starts at the current virtual time, like a tenant coming back from idle */
+	tenant->pass = __atomic_load_n(&pool->tenant_vtime, __ATOMIC_RELAXED);
+	pool->tenants[n] = tenant;
+	__atomic_store_n(&pool->ntenants, n + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pool->mutex);
+	return n;
+}
+/* }}} */
+
+/* waits until the queue of the tenant can take a job again, same as spindle_wait_for_slot() but on the tenant's condition */
+static void spindle_tenant_wait(spindle_t *pool, spindle_tenant_t *tenant) /* {{{ */
+{
+	unsigned long since;
+
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *) &pool->mutex);
+
+	__atomic_add_fetch(&tenant->blocked, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!queue_can_accept_order(&tenant->queue)) {
+		since = spindle_clock_usec();
+		pthread_cond_wait(&tenant->taken, &pool->mutex);
+		__atomic_add_fetch(&tenant->blocked_waits, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tenant->blocked_usec, spindle_clock_usec() - since, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&tenant->blocked, 1, __ATOMIC_SEQ_CST);
+
+	pthread_cleanup_pop(1);
+}
+/* }}} */
+
+int spindle_dispatch_tenant(spindle_t *pool, int tenant, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg) /* {{{ */
+{
+	spindle_worker_t *self = spindle_current_worker;
+	spindle_tenant_t *t;
+	spindle_job_t job;
+
+	if (tenant == 0) {
+		spindle_dispatch_prio_with_cleanup(pool, 0, barrier, dispatch_to_here, arg, NULL, NULL);
+		return 0;
+	}
+	if (tenant < 0 || tenant >= __atomic_load_n(&pool->ntenants, __ATOMIC_ACQUIRE)) {
+		return EINVAL;
+	}
+	t = pool->tenants[tenant];
+
+	job.func = dispatch_to_here;
+	job.arg = arg;
+	job.cleanup_func = NULL;
+	job.cleanup_arg = NULL;
+	job.barrier = barrier;
+	job.len = 0;
+	job.queued = pool->timing ? spindle_clock_usec() : 0;
+	if (barrier) {
+		spindle_barrier_add(barrier, 1);
+	}
+
+	if (self && self->pool == pool) {
+		spindle_worker_post(self, &t->queue, &t->blocked, &job);
+		return 0;
+	}
+	while (0 != queue_post_job(&t->queue, &job)) {
+		spindle_tenant_wait(pool, t);
+	}
+	spindle_wake_idle(pool);
+	return 0;
+}
+/* }}} */
+
+void spindle_dispatch_with_cleanup(spindle_t *from_me, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void * cleaner_arg) /* {{{ */
+{
+	spindle_dispatch_prio_with_cleanup(from_me, 0, barrier, dispatch_to_here, arg, cleaner_func, cleaner_arg);
+}
+/* }}} */
+
+void spindle_dispatch_batch(spindle_t *pool, spindle_barrier_t *barrier, const spindle_batch_job_t *jobs, int n) /* {{{ */
+{
+	spindle_worker_t *self = spindle_current_worker;
+	spindle_queue_head_t *queue;
+	unsigned long queued;
+	int posted;
+
+	if (n <= 0) {
+		return;
+	}
+	queued = pool->timing ? spindle_clock_usec() : 0;
+
+	if (barrier) {
+		spindle_barrier_add(barrier, n);
+	}
+
+	queue = spindle_local_queue(pool, self);
+	while (n > 0) {
+		posted = queue_post_jobs(queue, barrier, jobs, n, queued);
+		TP_DEBUG(pool, " <<< Dispatcher: posted %d of %d jobs\n", posted, n);
+
+		/* there's no point in waking up more workers than there are jobs */
+		spindle_wake_idle_n(pool, posted);
+		jobs += posted;
+		n -= posted;
+
+		if (n > 0 && posted == 0) {
+			if (self && self->pool == pool) {
+				spindle_job_t job;
+
+				job.func = jobs->func;
+				job.arg = jobs->arg;
+				job.cleanup_func = jobs->cleanup_func;
+				job.cleanup_arg = jobs->cleanup_arg;
+				job.barrier = barrier;
+				job.queued = queued;
+				job.len = 0;
+				spindle_worker_post(self, queue, &pool->blocked, &job);
+				jobs++;
+				n--;
+			} else {
+				spindle_wait_for_slot(pool, queue, NULL);
+			}
+		}
+	}
+}
+/* }}} */
+
+static int spindle_tickets_open(spindle_t *pool) /* {{{ */
+{
+	spindle_slab_t *slab;
+	int err = 0;
+
+	if (__atomic_load_n(&pool->ticket_slab, __ATOMIC_ACQUIRE) != NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->ticket_slab == NULL) {
+		if (0 != posix_memalign((void **)&slab, SPINDLE_CACHELINE_SIZE, sizeof(spindle_slab_t))) {
+			err = ENOMEM;
+		} else {
+			spindle_slab_init(slab, sizeof(spindle_ticket_t));
+			__atomic_store_n(&pool->ticket_slab, slab, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return err;
+}
+/* }}} */
+
+static void spindle_tickets_destroy(spindle_t *pool) /* {{{ */
+{
+	if (pool->ticket_slab == NULL) {
+		return;
+	}
+	spindle_slab_destroy(pool->ticket_slab);
+	free(pool->ticket_slab);
+	pool->ticket_slab = NULL;
+}
+/* }}} */
+
+static inline void spindle_ticket_unref(spindle_ticket_t *ticket) /* {{{ */
+{
+	if (__atomic_sub_fetch(&ticket->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		spindle_slab_free(ticket->pool->ticket_slab, ticket);
+	}
+}
+/* }}} */
+
+/* a dropped job still gets its cleanup and counts in the barrier, as if it had run */
+static void spindle_ticket_drop(spindle_ticket_t *ticket) /* {{{ */
+{
+	if (ticket->cleanup_func) {
+		ticket->cleanup_func(ticket->cleanup_arg);
+	}
+	if (ticket->barrier) {
+		spindle_barrier_signal(ticket->barrier);
+	}
+}
+/* }}} */
+
+static void spindle_ticket_run(void *arg) /* {{{ */
+{
+	spindle_ticket_t *ticket = (spindle_ticket_t *)arg;
+	spindle_job_t job;
+	int state = SPINDLE_TICKET_QUEUED;
+	struct timeval now;
+
+	if (ticket->deadline) {
+		gettimeofday(&now, NULL);
+		if ((unsigned long)now.tv_sec * 1000000UL + now.tv_usec >= ticket->deadline) {
+			if (__atomic_compare_exchange_n(&ticket->state, &state, SPINDLE_TICKET_DROPPED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				TP_DEBUG(ticket->pool, " --- Worker: dropping an expired job\n");
+				spindle_ticket_drop(ticket);
+				__atomic_add_fetch(&ticket->pool->expired, 1, __ATOMIC_RELAXED);
+			}
+			spindle_ticket_unref(ticket);
+			return;
+		}
+	}
+
+	if (__atomic_compare_exchange_n(&ticket->state, &state, SPINDLE_TICKET_STARTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		job.func = ticket->func;
+		job.arg = ticket->arg;
+		job.cleanup_func = ticket->cleanup_func;
+		job.cleanup_arg = ticket->cleanup_arg;
+		job.barrier = ticket->barrier;
+		job.len = 0;
+		spindle_run_job(&job);
+	}
+	/* else it has been cancelled */
+	spindle_ticket_unref(ticket);
+}
+/* }}} */
+
+/* common part of spindle_dispatch_deadline() and spindle_dispatch_cancellable(), refs is 2 if the caller keeps a handle */
+static spindle_ticket_t *spindle_ticket_dispatch(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg, const struct timespec *deadline, int refs, int *err) /* {{{ */
+{
+	spindle_ticket_t *ticket;
+	spindle_job_t job;
+
+	if (__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED)) {
+		*err = ESHUTDOWN;
+		return NULL;
+	}
+	if (0 != spindle_tickets_open(pool) || NULL == (ticket = spindle_slab_alloc(pool->ticket_slab))) {
+		*err = ENOMEM;
+		return NULL;
+	}
+
+	ticket->state = SPINDLE_TICKET_QUEUED;
+	ticket->refcount = refs;
+	ticket->pool = pool;
+	ticket->func = dispatch_to_here;
+	ticket->arg = arg;
+	ticket->cleanup_func = cleaner_func;
+	ticket->cleanup_arg = cleaner_arg;
+	ticket->barrier = barrier;
+	ticket->deadline = deadline ? (unsigned long)deadline->tv_sec * 1000000UL + deadline->tv_nsec / 1000 : 0;
+	if (barrier) {
+		spindle_barrier_add(barrier, 1);
+	}
+
+	/* the barrier is the ticket's, the job itself is not counted */
+	job.func = spindle_ticket_run;
+	job.arg = ticket;
+	job.cleanup_func = NULL;
+	job.cleanup_arg = NULL;
+	job.barrier = NULL;
+	job.len = 0;
+	*err = spindle_dispatch_job(pool, 0, -1, &job, 1, deadline);
+	if (*err != 0) {
+		if (barrier) {
+			spindle_barrier_signal(barrier);
+		}
+		spindle_slab_free(pool->ticket_slab, ticket);
+		return NULL;
+	}
+	return ticket;
+}
+/* }}} */
+
+int spindle_dispatch_deadline(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg, const struct timespec *deadline) /* {{{ */
+{
+	int err;
+
+	spindle_ticket_dispatch(pool, barrier, dispatch_to_here, arg, cleaner_func, cleaner_arg, deadline, 1, &err);
+	return err;
+}
+/* }}} */
+
+spindle_ticket_t *spindle_dispatch_cancellable(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg, const struct timespec *deadline) /* {{{ */
+{
+	spindle_ticket_t *ticket;
+	int err;
+
+	ticket = spindle_ticket_dispatch(pool, barrier, dispatch_to_here, arg, cleaner_func, cleaner_arg, deadline, 2, &err);
+	if (ticket == NULL) {
+		errno = err;
+	}
+	return ticket;
+}
+/* }}} */
+
+int spindle_cancel(spindle_ticket_t *ticket) /* {{{ */
+{
+	int state = SPINDLE_TICKET_QUEUED;
+	int err = EALREADY;
+
+	/* the job stays in the queue, the worker that takes it finds it dropped */
+	if (__atomic_compare_exchange_n(&ticket->state, &state, SPINDLE_TICKET_DROPPED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		spindle_ticket_drop(ticket);
+		__atomic_add_fetch(&ticket->pool->cancelled, 1, __ATOMIC_RELAXED);
+		err = 0;
+	}
+	spindle_ticket_unref(ticket);
+	return err;
+}
+/* }}} */
+
+void spindle_ticket_release(spindle_ticket_t *ticket) /* {{{ */
+{
+	spindle_ticket_unref(ticket);
+}
+/* }}} */
+
+static inline int spindle_strand_bucket(unsigned long key) /* {{{ */
+{
+	/* Fibonacci hashing, sequential keys (session ids...) spread over the buckets */
+	return (int)(((key * 0x9e3779b97f4a7c15UL) >> 32) % SPINDLE_STRAND_BUCKETS);
+}
+/* }}} */
+
+static int spindle_strands_open(spindle_t *pool) /* {{{ */
+{
+	spindle_strands_t *strands;
+	int err = 0;
+
+	if (__atomic_load_n(&pool->strands, __ATOMIC_ACQUIRE) != NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->strands == NULL) {
+		if (0 != posix_memalign((void **)&strands, SPINDLE_CACHELINE_SIZE, sizeof(spindle_strands_t))) {
+			err = ENOMEM;
+		} else {
+			memset(strands, 0, sizeof(spindle_strands_t));
+			spindle_slab_init(&strands->strand_slab, sizeof(spindle_strand_t));
+			spindle_slab_init(&strands->job_slab, sizeof(spindle_strand_job_t));
+			__atomic_store_n(&pool->strands, strands, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return err;
+}
+/* }}} */
+
+/* the strands are all gone once the queues are empty, the jobs left behind by spindle_destroy_immediately() are dropped */
+static void spindle_strands_destroy(spindle_t *pool) /* {{{ */
+{
+	if (pool->strands == NULL) {
+		return;
+	}
+	spindle_slab_destroy(&pool->strands->strand_slab);
+	spindle_slab_destroy(&pool->strands->job_slab);
+	free(pool->strands);
+	pool->strands = NULL;
+}
+/* }}} */
+
+/* runs the jobs of a strand one after the other: the job at the head stays there while it runs,
+ * so that the dispatchers see the strand busy, and the strand is dropped with its last job */
+static void spindle_strand_run(void *arg) /* {{{ */
+{
+	spindle_strand_t *strand = (spindle_strand_t *)arg;
+	spindle_t *pool = strand->pool;
+	spindle_strands_t *strands = pool->strands;
+	volatile int *lock = &strands->buckets[strand->bucket].lock;
+	spindle_strand_t **prev;
+	spindle_strand_job_t *sjob;
+	spindle_job_t job;
+	int n;
+
+	for (n = 1; ; n++) {
+		/* only the runner moves the head */
+		sjob = strand->head;
+		sjob->func(sjob->arg);
+		if (sjob->barrier) {
+			spindle_barrier_signal(sjob->barrier);
+		}
+
+		spindle_spin_lock(lock);
+		strand->head = sjob->next;
+		if (strand->head == NULL) {
+			for (prev = &strands->buckets[strand->bucket].head; *prev != strand; prev = &(*prev)->next);
+			*prev = strand->next;
+			spindle_spin_unlock(lock);
+			spindle_slab_free(&strands->job_slab, sjob);
+			spindle_slab_free(&strands->strand_slab, strand);
+			return;
+		}
+		spindle_spin_unlock(lock);
+		spindle_slab_free(&strands->job_slab, sjob);
+
+		if (n % SPINDLE_STRAND_BATCH == 0) {
+			/* let the other jobs in: straight to the shared queue, behind the jobs waiting there,
+			   as the deque of this worker would hand the strand right back; if the queue is full, just go on */
+			job.func = spindle_strand_run;
+			job.arg = strand;
+			job.cleanup_func = NULL;
+			job.cleanup_arg = NULL;
+			job.barrier = NULL;
+			job.len = 0;
+			if (pool->timing) {
+				job.queued = spindle_clock_usec();
+			} else {
+				job.queued = (pool->priorities > 1) ? spindle_now_usec() : 0;
+			}
+			if (0 == queue_post_job(spindle_local_queue(pool, spindle_current_worker), &job)) {
+				spindle_wake_idle(pool);
+				return;
+			}
+		}
+	}
+}
+/* }}} */
+
+int spindle_dispatch_keyed(spindle_t *pool, unsigned long key, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg) /* {{{ */
+{
+	spindle_strands_t *strands;
+	spindle_strand_t *strand;
+	spindle_strand_job_t *sjob;
+	spindle_job_t job;
+	int bucket;
+
+	if (0 != spindle_strands_open(pool)) {
+		return ENOMEM;
+	}
+	strands = pool->strands;
+
+	sjob = spindle_slab_alloc(&strands->job_slab);
+	if (sjob == NULL) {
+		return ENOMEM;
+	}
+	sjob->func = dispatch_to_here;
+	sjob->arg = arg;
+	sjob->barrier = barrier;
+	sjob->next = NULL;
+	if (barrier) {
+		spindle_barrier_add(barrier, 1);
+	}
+
+	bucket = spindle_strand_bucket(key);
+	spindle_spin_lock(&strands->buckets[bucket].lock);
+	for (strand = strands->buckets[bucket].head; strand != NULL && strand->key != key; strand = strand->next);
+	if (strand != NULL) {
+		/* the strand is queued or running already, its runner takes the job */
+		strand->tail->next = sjob;
+		strand->tail = sjob;
+		spindle_spin_unlock(&strands->buckets[bucket].lock);
+		return 0;
+	}
+
+	strand = spindle_slab_alloc(&strands->strand_slab);
+	if (strand == NULL) {
+		spindle_spin_unlock(&strands->buckets[bucket].lock);
+		if (barrier) {
+			spindle_barrier_signal(barrier);
+		}
+		spindle_slab_free(&strands->job_slab, sjob);
+		return ENOMEM;
+	}
+	strand->pool = pool;
+	strand->key = key;
+	strand->bucket = bucket;
+	strand->head = strand->tail = sjob;
+	strand->next = strands->buckets[bucket].head;
+	strands->buckets[bucket].head = strand;
+	spindle_spin_unlock(&strands->buckets[bucket].lock);
+
+	job.func = spindle_strand_run;
+	job.arg = strand;
+	job.cleanup_func = NULL;
+	job.cleanup_arg = NULL;
+	job.barrier = NULL;
+	job.len = 0;
+	spindle_dispatch_job(pool, 0, -1, &job, 1, NULL);
+	return 0;
+}
+/* }}} */
+
+static inline void spindle_pfor_release(spindle_pfor_t *pf) /* {{{ */
+{
+	if (__atomic_sub_fetch(&pf->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(pf);
+	}
+}
+/* }}} */
+
+/* claims and runs chunks until the range is exhausted; chunks get smaller towards
+ * the end of the range (guided scheduling), so that there is no long tail */
+static void spindle_pfor_run(void *arg) /* {{{ */
+{
+	spindle_pfor_t *pf = (spindle_pfor_t *)arg;
+	long begin, chunk, left;
+
+	begin = __atomic_load_n(&pf->next, __ATOMIC_RELAXED);
+	while (begin < pf->end) {
+		left = pf->end - begin;
+		chunk = left / (2 * pf->participants);
+		if (chunk < pf->grain) {
+			chunk = pf->grain;
+		}
+		if (chunk > left) {
+			chunk = left;
+		}
+		if (!__atomic_compare_exchange_n(&pf->next, &begin, begin + chunk, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		pf->body(begin, begin + chunk, pf->arg);
+
+		if (__atomic_sub_fetch(&pf->remaining, chunk, __ATOMIC_ACQ_REL) == 0) {
+			spindle_barrier_signal(&pf->barrier);
+		}
+		begin = __atomic_load_n(&pf->next, __ATOMIC_RELAXED);
+	}
+	spindle_pfor_release(pf);
+}
+/* }}} */
+
+void spindle_parallel_for(spindle_t *pool, long begin, long end, long grain, spindle_range_func_t body, void *arg) /* {{{ */
+{
+	spindle_worker_t *self = spindle_current_worker;
+	spindle_batch_job_t helpers[SPINDLE_PFOR_BATCH];
+	spindle_pfor_t *pf;
+	unsigned long span, chunks;
+	int i, n, posted;
+
+	if (begin >= end) {
+		return;
+	}
+
+	if (grain <= 0) {
+		grain = 1;
+	}
+
+	span = (unsigned long)end - (unsigned long)begin;
+	if (span > LONG_MAX) {
+		/* the sizes wouldn't fit in a long, run it in two halves */
+		spindle_parallel_for(pool, begin, begin + (long)(span / 2), grain, body, arg);
+		spindle_parallel_for(pool, begin + (long)(span / 2), end, grain, body, arg);
+		return;
+	}
+
+	/* one helper per worker at most, the caller is a participant too */
+	chunks = span / grain + (span % grain != 0);
+	n = __atomic_load_n(&pool->size, __ATOMIC_RELAXED);
+	if (self && self->pool == pool) {
+		n--;
+	}
+	if (n > SPINDLE_MAX_IN_POOL) {
+		n = SPINDLE_MAX_IN_POOL;
+	}
+	if ((unsigned long)n > chunks - 1) {
+		n = (int)(chunks - 1);
+	}
+
+	/* the counters are on cache lines of their own */
+	if (n <= 0 || 0 != posix_memalign((void **)&pf, SPINDLE_CACHELINE_SIZE, sizeof(spindle_pfor_t))) {
+		/* not worth splitting (or no memory to do that) */
+		body(begin, end, arg);
+		return;
+	}
+
+	pf->next = begin;
+	pf->end = end;
+	pf->grain = grain;
+	pf->remaining = (long)span;
+	pf->participants = n + 1;
+	pf->body = body;
+	pf->arg = arg;
+	pf->barrier.pending = 1; /* the whole range */
+	/* one reference per helper and two for us (as a participant and as the waiter):
+	   helpers that start after the range is done just drop their reference,
+	   so we don't have to wait for them */
+	pf->refcount = n + 2;
+
+	for (i = 0; i < SPINDLE_PFOR_BATCH; i++) {
+		helpers[i].func = spindle_pfor_run;
+		helpers[i].arg = pf;
+		helpers[i].cleanup_func = NULL;
+		helpers[i].cleanup_arg = NULL;
+	}
+	for (i = 0; i < n; i += posted) {
+		posted = (n - i < SPINDLE_PFOR_BATCH) ? n - i : SPINDLE_PFOR_BATCH;
+		spindle_dispatch_batch(pool, NULL, helpers, posted);
+	}
+
+	spindle_pfor_run(pf);
+	spindle_barrier_wait(&pf->barrier);
+	spindle_pfor_release(pf);
+}
+/* }}} */
+
+static inline void spindle_future_unref(spindle_future_t *f) /* {{{ */
+{
+	if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		spindle_slab_free(f->pool->future_slab, f);
+	}
+}
+/* }}} */
+
+/* makes completion_fd readable, unless it is already */
+static inline void spindle_completion_signal(spindle_t *pool) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_EVENTFD
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+
+	if (__atomic_exchange_n(&pool->completion_signalled, 1, __ATOMIC_SEQ_CST) == 0) {
+		/* EAGAIN: a full pipe is readable anyway */
+		while (write(pool->completion_wfd, &one, sizeof(one)) < 0 && errno == EINTR);
+	}
+}
+/* }}} */
+
+/* queues a finished task for spindle_reap(), only the first push of a batch costs a syscall */
+static inline void spindle_completion_push(spindle_t *pool, spindle_future_t *f) /* {{{ */
+{
+	spindle_future_t *head;
+
+	head = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+	do {
+		f->next = head;
+	} while (!__atomic_compare_exchange_n(&pool->completed, &head, f, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	spindle_completion_signal(pool);
+}
+/* }}} */
+
+/* creates completion_fd on first use, returns 0 or an errno value */
+static int spindle_completion_open(spindle_t *pool) /* {{{ */
+{
+	int fds[2], err = 0;
+
+	if (__atomic_load_n(&pool->completion_fd, __ATOMIC_ACQUIRE) >= 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->completion_fd < 0) {
+#ifdef SPINDLE_HAVE_EVENTFD
+		fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fds[0] < 0) {
+			err = errno;
+		}
+#else
+		if (0 != pipe(fds)) {
+			err = errno;
+		} else {
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(fds[1], F_SETFL, O_NONBLOCK);
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		}
+#endif
+		if (err == 0) {
+			pool->completion_wfd = fds[1];
+			__atomic_store_n(&pool->completion_fd, fds[0], __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return err;
+}
+/* }}} */
+
+/* the unreaped futures go away with the slab */
+static void spindle_completion_close(spindle_t *pool) /* {{{ */
+{
+	if (pool->completion_fd >= 0) {
+		if (pool->completion_wfd != pool->completion_fd) {
+			close(pool->completion_wfd);
+		}
+		close(pool->completion_fd);
+	}
+}
+/* }}} */
+
+static void spindle_future_run(void *arg) /* {{{ */
+{
+	spindle_future_t *f = (spindle_future_t *)arg;
+	spindle_future_t *cont, *next;
+
+	while (f) {
+		f->result = f->func(f->arg);
+
+		/* only the waiters of this very future are woken up */
+		if (__atomic_exchange_n(&f->state, SPINDLE_FUTURE_DONE, __ATOMIC_SEQ_CST) & SPINDLE_FUTURE_WAITERS) {
+			spindle_futex_wake(&f->state, INT_MAX);
+			spindle_fiber_wake(&f->state);
+		}
+
+		/* close the list of continuations, the first one is run right here
+		   while the data is still hot, the others are dispatched */
+		cont = __atomic_exchange_n(&f->continuations, SPINDLE_FUTURE_CLOSED, __ATOMIC_ACQ_REL);
+		if (f->notify) {
+			/* spindle_reap() drops the reference of the job */
+			spindle_completion_push(f->pool, f);
+		} else {
+			spindle_future_unref(f);
+		}
+
+		f = cont;
+		if (f) {
+			for (cont = f->next; cont; cont = next) {
+				next = cont->next;
+				spindle_dispatch_prio_with_cleanup(cont->pool, 0, NULL, spindle_future_run, cont, NULL, NULL);
+			}
+		}
+	}
+}
+/* }}} */
+
+static spindle_future_t *spindle_future_alloc(spindle_t *pool, spindle_task_func_t func, void *arg) /* {{{ */
+{
+	spindle_future_t *f;
+
+	f = spindle_slab_alloc(pool->future_slab);
+	if (f == NULL) {
+		return NULL;
+	}
+
+	f->state = 0;
+	f->refcount = 2;
+	f->pool = pool;
+	f->func = func;
+	f->arg = arg;
+	f->result = NULL;
+	f->continuations = NULL;
+	f->next = NULL;
+	f->notify = 0;
+	return f;
+}
+/* }}} */
+
+spindle_future_t *spindle_submit(spindle_t *pool, spindle_task_func_t func, void *arg) /* {{{ */
+{
+	spindle_future_t *f;
+
+	f = spindle_future_alloc(pool, func, arg);
+	if (f == NULL) {
+		return NULL;
+	}
+
+	spindle_dispatch_prio_with_cleanup(pool, 0, NULL, spindle_future_run, f, NULL, NULL);
+	return f;
+}
+/* }}} */
+
+spindle_future_t *spindle_then(spindle_future_t *f, spindle_task_func_t func, void *arg) /* {{{ */
+{
+	spindle_future_t *cont, *head;
+
+	cont = spindle_future_alloc(f->pool, func, arg);
+	if (cont == NULL) {
+		return NULL;
+	}
+
+	head = __atomic_load_n(&f->continuations, __ATOMIC_ACQUIRE);
+	do {
+		if (head == SPINDLE_FUTURE_CLOSED) {
+			/* f is done already */
+			spindle_dispatch_prio_with_cleanup(f->pool, 0, NULL, spindle_future_run, cont, NULL, NULL);
+			return cont;
+		}
+		cont->next = head;
+	} while (!__atomic_compare_exchange_n(&f->continuations, &head, cont, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+	return cont;
+}
+/* }}} */
+
+int spindle_future_get_timed(spindle_future_t *f, const struct timespec *abstime, void **result) /* {{{ */
+{
+	int state;
+
+	state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+	while (!(state & SPINDLE_FUTURE_DONE)) {
+		if (!(state & SPINDLE_FUTURE_WAITERS)) {
+			if (!__atomic_compare_exchange_n(&f->state, &state, state | SPINDLE_FUTURE_WAITERS, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			state |= SPINDLE_FUTURE_WAITERS;
+		}
+		if (ETIMEDOUT == spindle_wait_word(&f->state, state, abstime)) {
+			if (!(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) & SPINDLE_FUTURE_DONE)) {
+				return ETIMEDOUT;
+			}
+		}
+		state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+	}
+
+	if (result) {
+		*result = f->result;
+	}
+	return 0;
+}
+/* }}} */
+
+void *spindle_future_wait(spindle_future_t *f) /* {{{ */
+{
+	void *result;
+
+	spindle_future_get_timed(f, NULL, &result);
+	return result;
+}
+/* }}} */
+
+void spindle_yield(void) /* {{{ */
+{
+#ifdef SPINDLE_HAVE_FIBERS
+	spindle_fiber_t *fiber = spindle_fiber_self();
+
+	if (fiber) {
+		spindle_fiber_suspend(fiber, spindle_fiber_requeue);
+		return;
+	}
+#endif
+	sched_yield();
+}
+/* }}} */
+
+int spindle_future_try_get(spindle_future_t *f, void **result) /* {{{ */
+{
+	if (!(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) & SPINDLE_FUTURE_DONE)) {
+		return EAGAIN;
+	}
+
+	if (result) {
+		*result = f->result;
+	}
+	return 0;
+}
+/* }}} */
+
+void spindle_future_release(spindle_future_t *f) /* {{{ */
+{
+	spindle_future_unref(f);
+}
+/* }}} */
+
+spindle_future_t *spindle_submit_completion(spindle_t *pool, spindle_task_func_t func, void *arg) /* {{{ */
+{
+	spindle_future_t *f;
+	int err;
+
+	err = spindle_completion_open(pool);
+	if (err != 0) {
+		errno = err;
+		return NULL;
+	}
+
+	f = spindle_future_alloc(pool, func, arg);
+	if (f == NULL) {
+		return NULL;
+	}
+
+	f->notify = 1;
+	spindle_dispatch_prio_with_cleanup(pool, 0, NULL, spindle_future_run, f, NULL, NULL);
+	return f;
+}
+/* }}} */
+
+int spindle_completion_fd(spindle_t *pool) /* {{{ */
+{
+	int err;
+
+	err = spindle_completion_open(pool);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return pool->completion_fd;
+}
+/* }}} */
+
+int spindle_reap(spindle_t *pool, spindle_completion_t *out, int max) /* {{{ */
+{
+	spindle_future_t *f, *next;
+	int n = 0;
+#ifdef SPINDLE_HAVE_EVENTFD
+	uint64_t count;
+#else
+	char count[64];
+#endif
+
+	if (max <= 0 || __atomic_load_n(&pool->completion_fd, __ATOMIC_ACQUIRE) < 0) {
+		return 0;
+	}
+
+	spindle_spin_lock(&pool->reap_lock);
+
+	/* consume the readiness before looking, the pushes from now on signal again */
+	if (__atomic_load_n(&pool->completion_signalled, __ATOMIC_RELAXED)) {
+		while (read(pool->completion_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+		__atomic_store_n(&pool->completion_signalled, 0, __ATOMIC_SEQ_CST);
+	}
+
+	while (n < max) {
+		if (pool->reaped == NULL) {
+			/* take the whole batch at once and put it in completion order */
+			f = __atomic_exchange_n(&pool->completed, NULL, __ATOMIC_SEQ_CST);
+			if (f == NULL) {
+				break;
+			}
+			for ( ; f; f = next) {
+				next = f->next;
+				f->next = pool->reaped;
+				pool->reaped = f;
+			}
+		}
+
+		f = pool->reaped;
+		pool->reaped = f->next;
+		out[n].future = f;
+		out[n].result = f->result;
+		n++;
+		spindle_future_unref(f);
+	}
+
+	/* keep the fd readable for the ones left */
+	if (pool->reaped != NULL || __atomic_load_n(&pool->completed, __ATOMIC_RELAXED) != NULL) {
+		spindle_completion_signal(pool);
+	}
+
+	spindle_spin_unlock(&pool->reap_lock);
+	return n;
+}
+/* }}} */
+
+static inline void spindle_timer_unref(spindle_timer_t *timer) /* {{{ */
+{
+	if (__atomic_sub_fetch(&timer->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(timer);
+	}
+}
+/* }}} */
+
+/* puts the timer in the slot of the level its expiry falls in, must be called with the wheel mutex held */
+static void spindle_wheel_insert(spindle_wheel_t *wheel, spindle_timer_t *timer) /* {{{ */
+{
+	spindle_timer_link_t *head;
+	unsigned long expires, delta;
+	int level;
+
+	expires = (timer->expires > wheel->now) ? timer->expires : wheel->now;
+	delta = expires - wheel->now;
+	if (delta >= SPINDLE_WHEEL_SPAN) {
+		/* looked at again when the slot is cascaded */
+		delta = SPINDLE_WHEEL_SPAN - 1;
+		expires = wheel->now + delta;
+	}
+	for (level = 0; level < SPINDLE_WHEEL_LEVELS - 1 && delta >= 1UL << (SPINDLE_WHEEL_BITS * (level + 1)); level++);
+
+	timer->level = level;
+	timer->slot = (int)(expires >> (SPINDLE_WHEEL_BITS * level)) & (SPINDLE_WHEEL_SLOTS - 1);
+	head = &wheel->slots[level][timer->slot];
+	timer->link.next = head;
+	timer->link.prev = head->prev;
+	head->prev->next = &timer->link;
+	head->prev = &timer->link;
+	wheel->occupied[level] |= 1ULL << timer->slot;
+	wheel->count++;
+}
+/* }}} */
+
+/* takes the timer out of the wheel, must be called with the wheel mutex held */
+static void spindle_wheel_unlink(spindle_wheel_t *wheel, spindle_timer_t *timer) /* {{{ */
+{
+	spindle_timer_link_t *head = &wheel->slots[timer->level][timer->slot];
+
+	timer->link.prev->next = timer->link.next;
+	timer->link.next->prev = timer->link.prev;
+	if (head->next == head) {
+		wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+	}
+	timer->level = -1;
+	wheel->count--;
+}
+/* }}} */
+
+/* empties a slot and returns its timers as a NULL terminated list linked by link.next */
+static spindle_timer_t *spindle_wheel_take(spindle_wheel_t *wheel, int level, int slot) /* {{{ */
+{
+	spindle_timer_link_t *head = &wheel->slots[level][slot], *first;
+
+	if (head->next == head) {
+		return NULL;
+	}
+
+	first = head->next;
+	head->prev->next = NULL;
+	head->next = head->prev = head;
+	wheel->occupied[level] &= ~(1ULL << slot);
+	return (spindle_timer_t *)first;
+}
+/* }}} */
+
+/* the first tick from wheel->now on that has a slot to expire or to cascade */
+static unsigned long spindle_wheel_next(spindle_wheel_t *wheel) /* {{{ */
+{
+	unsigned long next = ULONG_MAX, span, first, t;
+	unsigned long long occupied;
+	int level, index;
+
+	for (level = 0; level < SPINDLE_WHEEL_LEVELS; level++) {
+		if (wheel->occupied[level] == 0) {
+			continue;
+		}
+		/* slots of level n are looked at on the multiples of 64^n ticks */
+		span = 1UL << (SPINDLE_WHEEL_BITS * level);
+		first = (wheel->now + span - 1) & ~(span - 1);
+		index = (int)(first >> (SPINDLE_WHEEL_BITS * level)) & (SPINDLE_WHEEL_SLOTS - 1);
+		occupied = wheel->occupied[level];
+		if (index > 0) {
+			occupied = (occupied >> index) | (occupied << (SPINDLE_WHEEL_SLOTS - index));
+		}
+		t = first + (unsigned long)__builtin_ctzll(occupied) * span;
+		if (t < next) {
+			next = t;
+		}
+	}
+	return next;
+}
+/* }}} */
+
+/* runs tick wheel->now on the way to tick now: cascades the upper levels that wrap around and adds the
+ * expired timers to *due (with a reference each), must be called with the wheel mutex held */
+static void spindle_wheel_tick(spindle_wheel_t *wheel, unsigned long now, spindle_timer_t **due) /* {{{ */
+{
+	spindle_timer_t *timer, *next;
+	unsigned long missed;
+	int level, index;
+
+	for (level = 1; level < SPINDLE_WHEEL_LEVELS; level++) {
+		if ((wheel->now >> (SPINDLE_WHEEL_BITS * (level - 1))) & (SPINDLE_WHEEL_SLOTS - 1)) {
+			break;
+		}
+		index = (int)(wheel->now >> (SPINDLE_WHEEL_BITS * level)) & (SPINDLE_WHEEL_SLOTS - 1);
+		for (timer = spindle_wheel_take(wheel, level, index); timer; timer = next) {
+			next = (spindle_timer_t *)timer->link.next;
+			wheel->count--;
+			spindle_wheel_insert(wheel, timer);
+		}
+	}
+
+	for (timer = spindle_wheel_take(wheel, 0, (int)wheel->now & (SPINDLE_WHEEL_SLOTS - 1)); timer; timer = next) {
+		next = (spindle_timer_t *)timer->link.next;
+		wheel->count--;
+		timer->level = -1;
+		if (timer->period) {
+			/* fixed rate, skipping the runs that are already late: up to now, so that
+			   the timer can't expire again (and be put on *due twice) in this pass */
+			timer->expires += timer->period;
+			if (timer->expires <= now) {
+				missed = (now - timer->expires) / timer->period + 1;
+				timer->expires += missed * timer->period;
+			}
+			spindle_wheel_insert(wheel, timer);
+			__atomic_add_fetch(&timer->refcount, 1, __ATOMIC_RELAXED);
+		}
+		/* one-shot timers hand the reference of the wheel over */
+		timer->due = *due;
+		*due = timer;
+	}
+}
+/* }}} */
+
+static inline unsigned long spindle_wheel_ticks(spindle_wheel_t *wheel, unsigned long usec) /* {{{ */
+{
+	return (usec > wheel->start) ? (usec - wheel->start) / SPINDLE_TIMER_TICK_USEC : 0;
+}
+/* }}} */
+
+static void *spindle_timer_thread(void *data) /* {{{ */
+{
+	spindle_t *pool = (spindle_t *)data;
+	spindle_wheel_t *wheel = pool->wheel;
+	spindle_timer_t *due, *timer, *next_due;
+	struct timespec abstime;
+	unsigned long now, next, usec;
+
+	pthread_mutex_lock(&wheel->mutex);
+	while (!wheel->stopping) {
+		now = spindle_wheel_ticks(wheel, spindle_clock_usec());
+		due = NULL;
+		/* jump over the ticks with nothing to do */
+		while (wheel->now <= now) {
+			next = spindle_wheel_next(wheel);
+			if (next > now) {
+				wheel->now = now + 1;
+				break;
+			}
+			wheel->now = next;
+			spindle_wheel_tick(wheel, now, &due);
+			wheel->now++;
+		}
+
+		if (due) {
+			pthread_mutex_unlock(&wheel->mutex);
+			/* in expiry order */
+			for (timer = due, due = NULL; timer; timer = next_due) {
+				next_due = timer->due;
+				timer->due = due;
+				due = timer;
+			}
+			/* blocks while the queue is full, like any dispatcher */
+			for (timer = due; timer; timer = due) {
+				due = timer->due;
+				spindle_dispatch(pool, NULL, timer->func, timer->arg);
+				spindle_timer_unref(timer);
+			}
+			pthread_mutex_lock(&wheel->mutex);
+			continue;
+		}
+
+		next = spindle_wheel_next(wheel);
+		wheel->sleep_until = next;
+		if (next == ULONG_MAX) {
+			pthread_cond_wait(&wheel->wake, &wheel->mutex);
+		} else {
+			usec = wheel->start + next * SPINDLE_TIMER_TICK_USEC;
+			now = spindle_clock_usec();
+			spindle_abstime(&abstime, (usec > now) ? usec - now : 0);
+			pthread_cond_timedwait(&wheel->wake, &wheel->mutex, &abstime);
+		}
+		wheel->sleep_until = 0;
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+	return NULL;
+}
+/* }}} */
+
+/* allocates the wheel and starts the timer thread on first use, returns 0 or an errno value */
+static int spindle_wheel_open(spindle_t *pool) /* {{{ */
+{
+	spindle_wheel_t *wheel;
+	int level, slot, err = 0;
+
+	if (__atomic_load_n(&pool->wheel, __ATOMIC_ACQUIRE) != NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->wheel == NULL) {
+		wheel = calloc(1, sizeof(spindle_wheel_t));
+		if (wheel == NULL) {
+			err = ENOMEM;
+		} else {
+			pthread_mutex_init(&wheel->mutex, NULL);
+			pthread_cond_init(&wheel->wake, NULL);
+			for (level = 0; level < SPINDLE_WHEEL_LEVELS; level++) {
+				for (slot = 0; slot < SPINDLE_WHEEL_SLOTS; slot++) {
+					wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+				}
+			}
+			wheel->start = spindle_clock_usec();
+			/* the thread reads pool->wheel */
+			pool->wheel = wheel;
+			err = pthread_create(&wheel->thread, NULL, spindle_timer_thread, (void *)pool);
+			if (err != 0) {
+				pool->wheel = NULL;
+				pthread_cond_destroy(&wheel->wake);
+				pthread_mutex_destroy(&wheel->mutex);
+				free(wheel);
+			}
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return err;
+}
+/* }}} */
+
+/* stops the timer thread, the timers still armed are dropped */
+static void spindle_wheel_destroy(spindle_t *pool) /* {{{ */
+{
+	spindle_wheel_t *wheel = pool->wheel;
+	spindle_timer_t *timer, *next;
+	int level, slot;
+
+	if (wheel == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&wheel->mutex);
+	wheel->stopping = 1;
+	pthread_cond_signal(&wheel->wake);
+	pthread_mutex_unlock(&wheel->mutex);
+	pthread_join(wheel->thread, NULL);
+
+	for (level = 0; level < SPINDLE_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < SPINDLE_WHEEL_SLOTS; slot++) {
+			for (timer = spindle_wheel_take(wheel, level, slot); timer; timer = next) {
+				next = (spindle_timer_t *)timer->link.next;
+				free(timer);
+			}
+		}
+	}
+	pthread_cond_destroy(&wheel->wake);
+	pthread_mutex_destroy(&wheel->mutex);
+	free(wheel);
+	pool->wheel = NULL;
+}
+/* }}} */
+
+static spindle_timer_t *spindle_timer_arm(spindle_t *pool, unsigned long delay_usec, unsigned long period_usec, spindle_job_func_t func, void *arg) /* {{{ */
+{
+	spindle_wheel_t *wheel;
+	spindle_timer_t *timer;
+	int err;
+
+	err = spindle_wheel_open(pool);
+	if (err != 0) {
+		errno = err;
+		return NULL;
+	}
+	wheel = pool->wheel;
+
+	timer = malloc(sizeof(spindle_timer_t));
+	if (timer == NULL) {
+		return NULL;
+	}
+
+	timer->pool = pool;
+	timer->func = func;
+	timer->arg = arg;
+	/* never early: rounded up to the next tick */
+	timer->period = (period_usec + SPINDLE_TIMER_TICK_USEC - 1) / SPINDLE_TIMER_TICK_USEC;
+	timer->refcount = 2;
+	timer->due = NULL;
+
+	pthread_mutex_lock(&wheel->mutex);
+	timer->expires = spindle_wheel_ticks(wheel, spindle_clock_usec() + delay_usec + SPINDLE_TIMER_TICK_USEC - 1);
+	spindle_wheel_insert(wheel, timer);
+	if (timer->expires < wheel->sleep_until) {
+		pthread_cond_signal(&wheel->wake);
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+	return timer;
+}
+/* }}} */
+
+spindle_timer_t *spindle_dispatch_after(spindle_t *pool, unsigned long delay_usec, spindle_job_func_t func, void *arg) /* {{{ */
+{
+	return spindle_timer_arm(pool, delay_usec, 0, func, arg);
+}
+/* }}} */
+
+spindle_timer_t *spindle_dispatch_every(spindle_t *pool, unsigned long period_usec, spindle_job_func_t func, void *arg) /* {{{ */
+{
+	if (period_usec == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return spindle_timer_arm(pool, period_usec, period_usec, func, arg);
+}
+/* }}} */
+
+int spindle_timer_cancel(spindle_timer_t *timer) /* {{{ */
+{
+	spindle_wheel_t *wheel = timer->pool->wheel;
+	int armed;
+
+	pthread_mutex_lock(&wheel->mutex);
+	armed = (timer->level >= 0);
+	if (armed) {
+		spindle_wheel_unlink(wheel, timer);
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+
+	if (armed) {
+		spindle_timer_unref(timer);
+	}
+	spindle_timer_unref(timer);
+	return armed ? 0 : EALREADY;
+}
+/* }}} */
+
+void spindle_timer_release(spindle_timer_t *timer) /* {{{ */
+{
+	spindle_timer_unref(timer);
+}
+/* }}} */
+
+spindle_graph_t *spindle_graph_create(spindle_t *pool) /* {{{ */
+{
+	spindle_graph_t *graph;
+
+	graph = calloc(1, sizeof(spindle_graph_t));
+	if (!graph) {
+		return NULL;
+	}
+
+	graph->pool = pool;
+	return graph;
+}
+/* }}} */
+
+spindle_task_t *spindle_graph_add(spindle_graph_t *graph, spindle_job_func_t func, void *arg) /* {{{ */
+{
+	spindle_task_t *task;
+
+	task = calloc(1, sizeof(spindle_task_t));
+	if (!task) {
+		return NULL;
+	}
+
+	task->graph = graph;
+	task->func = func;
+	task->arg = arg;
+	task->next = graph->tasks;
+	graph->tasks = task;
+	graph->ntasks++;
+	return task;
+}
+/* }}} */
+
+int spindle_graph_depend(spindle_task_t *task, spindle_task_t *predecessor) /* {{{ */
+{
+	spindle_task_t **succ;
+	int size;
+
+	if (task->graph != predecessor->graph || task == predecessor) {
+		return EINVAL;
+	}
+
+	if (predecessor->nsucc == predecessor->succ_size) {
+		size = predecessor->succ_size ? predecessor->succ_size * 2 : 4;
+		succ = realloc(predecessor->succ, size * sizeof(spindle_task_t *));
+		if (!succ) {
+			return ENOMEM;
+		}
+		predecessor->succ = succ;
+		predecessor->succ_size = size;
+	}
+
+	predecessor->succ[predecessor->nsucc++] = task;
+	task->ndeps++;
+	return 0;
+}
+/* }}} */
+
+/* runs a task and then the tasks that became ready because of it: the first one
+ * right here, the others are dispatched (to the local deque if the pool is work-stealing) */
+static void spindle_task_run(void *arg) /* {{{ */
+{
+	spindle_task_t *task = (spindle_task_t *)arg;
+	spindle_graph_t *graph = task->graph;
+	spindle_task_t *next;
+	int i;
+
+	while (task) {
+		task->func(task->arg);
+
+		next = NULL;
+		for (i = 0; i < task->nsucc; i++) {
+			if (__atomic_sub_fetch(&task->succ[i]->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+				continue;
+			}
+			if (next == NULL) {
+				next = task->succ[i];
+			} else {
+				spindle_dispatch(graph->pool, graph->barrier, spindle_task_run, task->succ[i]);
+			}
+		}
+
+		task = next;
+	}
+}
+/* }}} */
+
+int spindle_graph_run(spindle_graph_t *graph, spindle_barrier_t *barrier) /* {{{ */
+{
+	spindle_task_t *task, **ready;
+	int i, nready = 0, head = 0;
+
+	if (graph->ntasks == 0) {
+		return 0;
+	}
+
+	/* make sure there are no cycles, or some of the tasks would never run */
+	ready = malloc(graph->ntasks * sizeof(spindle_task_t *));
+	if (!ready) {
+		return ENOMEM;
+	}
+
+	for (task = graph->tasks; task; task = task->next) {
+		task->pending = task->ndeps;
+		if (task->ndeps == 0) {
+			ready[nready++] = task;
+		}
+	}
+
+	while (head < nready) {
+		task = ready[head++];
+		for (i = 0; i < task->nsucc; i++) {
+			if (--task->succ[i]->pending == 0) {
+				ready[nready++] = task->succ[i];
+			}
+		}
 	}
-	job_queue->head = NULL;
-	job_queue->tail = NULL;
-	job_queue->free_head = (spindle_queue_node_t *) malloc (sizeof(spindle_queue_node_t));
 
-	if (job_queue->free_head == NULL) {
-		free(job_queue);
-		return NULL;
+	if (nready != graph->ntasks) {
+		free(ready);
+		return EDEADLK;
 	}
-	job_queue->free_tail = job_queue->free_head;
 
-	/* populate the free queue */
-	for(i = 0; i< initial_cap; i++) {
-		temp = (spindle_queue_node_t *) malloc (sizeof(spindle_queue_node_t));
-		if (temp == NULL) {
-			return job_queue;
+	/* only the roots are dispatched, the rest is up to the workers */
+	nready = 0;
+	for (task = graph->tasks; task; task = task->next) {
+		task->pending = task->ndeps;
+		if (task->ndeps == 0) {
+			ready[nready++] = task;
 		}
-		temp->next = job_queue->free_head;
-		temp->prev = NULL;
-		job_queue->free_head->prev = temp;
-		job_queue->free_head = temp;
 	}
 
-	return job_queue;
+	graph->barrier = barrier;
+	for (i = 0; i < nready; i++) {
+		spindle_dispatch(graph->pool, barrier, spindle_task_run, ready[i]);
+	}
+	free(ready);
+	return 0;
 }
 /* }}} */
 
-static inline void queue_destroy(spindle_queue_head_t *queue) /* {{{ */
+void spindle_graph_destroy(spindle_graph_t *graph) /* {{{ */
 {
-	spindle_queue_node_t *node, *temp;
+	spindle_task_t *task, *next;
 
-	temp = queue->head;
-	while (temp) {
-		node = temp;
-		temp = node->next;
-		free(node);
-	}
-	
-	temp = queue->free_head;
-	while (temp) {
-		node = temp;
-		temp = node->next;
-		free(node);
+	for (task = graph->tasks; task; task = next) {
+		next = task->next;
+		free(task->succ);
+		free(task);
 	}
-	free(queue);
+	free(graph);
 }
 /* }}} */
 
-static inline void queue_post_job(spindle_queue_head_t * job_queue, spindle_barrier_t *barrier, spindle_job_func_t func1, void * arg1, spindle_job_func_t func2, void * arg2) /* {{{ */
+void spindle_apply(spindle_t *p, spindle_apply_func_t func, void *arg) /* {{{ */
 {
-	spindle_queue_node_t *temp;
-		
-	if (job_queue->free_tail == NULL) {
-	    temp = (spindle_queue_node_t *) malloc (sizeof(spindle_queue_node_t));
-		if (temp == NULL) {
-			return;
-		}
-		temp->next = NULL;
-		temp->prev = NULL;
-		job_queue->free_head = temp;
-		job_queue->free_tail = temp;
-		job_queue->capacity++;
-	}
-	
-	temp = job_queue->free_tail;
-	if (job_queue->free_tail->prev == NULL) {
-		job_queue->free_tail = NULL;
-		job_queue->free_head = NULL;
-	} else {
-		job_queue->free_tail->prev->next= NULL;
-		job_queue->free_tail = job_queue->free_tail->prev;
-		job_queue->free_tail->next = NULL;
-	}
+	spindle_t *pool = (spindle_t *) p;
+	int i;
 
-	job_queue->posted++;
-	temp->func_to_dispatch = func1;
-	temp->func_arg = arg1;
-	temp->cleanup_func = func2;
-	temp->cleanup_arg = arg2;
-	temp->barrier = barrier;
-	if (barrier) {
-		barrier->posted_count++;
+	if (!func) {
+		return;
 	}
 
-	temp->prev = job_queue->tail;
-	temp->next = NULL;
-
-	if (job_queue->tail) {
-		job_queue->tail->next = temp;
-	} else {
-		job_queue->head = temp;
+	/* the workers running at the moment, the pool may be resized in the meantime */
+	for (i = 0; i < __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE); i++) {
+		if (__atomic_load_n(&pool->workers[i]->state, __ATOMIC_RELAXED) == SPINDLE_WORKER_RUNNING) {
+			func(&pool->workers[i]->thread, i, arg);
+		}
 	}
-	job_queue->tail = temp;
 }
 /* }}} */
 
-static inline void queue_fetch_job(spindle_queue_head_t * job_queue, spindle_barrier_t **barrier, spindle_job_func_t * func1, void ** arg1, spindle_job_func_t * func2, void ** arg2) /* {{{ */
+int spindle_queue_get_posted(spindle_t *p) /* {{{ */
 {
-	spindle_queue_node_t *temp;
-		
-	temp = job_queue->tail;
-	if (temp == NULL) {
-		return;
+	spindle_t *pool = (spindle_t *) p;
+	int size = 0, i;
+
+	for (i = 0; i < pool->priorities; i++) {
+		size += queue_get_posted(&pool->job_queue[i]);
 	}
 
-	if (temp->prev) {
-		temp->prev->next = NULL;
-	} else {
-		job_queue->head = NULL;
+	if (pool->scheduler == SPINDLE_SCHED_STEALING) {
+		for (i = 0; i < __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE); i++) {
+			size += deque_size(&pool->workers[i]->deque);
+		}
+	}
+
+	for (i = 0; pool->nodes && i < pool->nnodes; i++) {
+		size += queue_get_posted(&pool->nodes[i].queue);
 	}
-	job_queue->tail = temp->prev;
 
-	*func1 = temp->func_to_dispatch;
-	*arg1  = temp->func_arg;
-	*func2 = temp->cleanup_func;
-	*arg2  = temp->cleanup_arg;
-	*barrier = temp->barrier;
+	for (i = 0; i < __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE); i++) {
+		size += queue_get_posted(&pool->workers[i]->mailbox);
+	}
 
-	temp->next = NULL;
-	temp->prev = NULL;
-	if (job_queue->free_head == NULL) {
-		job_queue->free_tail = temp;
-		job_queue->free_head = temp;
-	} else {
-		temp->next = job_queue->free_head;
-		job_queue->free_head->prev = temp;
-		job_queue->free_head = temp;
+	for (i = 1; i < __atomic_load_n(&pool->ntenants, __ATOMIC_ACQUIRE); i++) {
+		size += queue_get_posted(&pool->tenants[i]->queue);
 	}
-	job_queue->posted--;
-}
-/* }}} */
 
-static inline int queue_can_accept_order(spindle_queue_head_t * job_queue) /* {{{ */
-{
-	return (job_queue->free_tail != NULL || job_queue->capacity <= job_queue->max_capacity);
+	return size;
 }
 /* }}} */
 
-static inline int queue_is_job_available(spindle_queue_head_t * job_queue) /* {{{ */
+int spindle_stats_get(spindle_t *pool, spindle_stats_t *stats) /* {{{ */
 {
-  return (job_queue->tail != NULL);
-}
-/* }}} */
+	spindle_worker_stats_t *ws;
+	spindle_tenant_stats_t *ts;
+	spindle_worker_t *worker;
+	spindle_tenant_t *tenant;
+	unsigned long now, started, parked, alive;
+	int i, b, peak, queued = 0;
 
+	memset(stats, 0, sizeof(spindle_stats_t));
+	now = spindle_clock_usec();
 
-#ifdef SPINDLE_DEBUG
-static inline void etfprintf(struct timeval then, ...) /* {{{ */
-{
-	va_list         args;
-	struct timeval  now;
-	struct timeval  diff;
-	FILE           *out;
-	char           *fmt;
+	stats->workers = __atomic_load_n(&pool->slots, __ATOMIC_ACQUIRE);
+	for (i = 0; i < stats->workers; i++) {
+		worker = __atomic_load_n(&pool->workers[i], __ATOMIC_ACQUIRE);
+		ws = &stats->worker[i];
 
-	va_start(args, then);
-	out = va_arg(args, FILE *);
-	fmt = va_arg(args, char *);
+		ws->running = (__atomic_load_n(&worker->state, __ATOMIC_RELAXED) == SPINDLE_WORKER_RUNNING);
+		ws->jobs = __atomic_load_n(&worker->stats.jobs, __ATOMIC_RELAXED);
+		ws->steals = __atomic_load_n(&worker->stats.steals, __ATOMIC_RELAXED);
+		ws->wakeups = __atomic_load_n(&worker->stats.wakeups, __ATOMIC_RELAXED);
+		ws->idle_usec = __atomic_load_n(&worker->stats.idle_usec, __ATOMIC_RELAXED);
+		parked = __atomic_load_n(&worker->stats.parked, __ATOMIC_RELAXED);
+		if (parked && now > parked) {
+			ws->idle_usec += now - parked;
+		}
 
-	gettimeofday(&now, NULL);
-	timersub(&now, &then, &diff);
-	fprintf(out, "%03d.%06d:", (int)diff.tv_sec, (int)diff.tv_usec);
-	vfprintf(out, fmt, args);
-	fflush(NULL);
-	va_end(args);
+		/* busy is whatever part of the lifetime of the slot wasn't spent sleeping */
+		alive = __atomic_load_n(&worker->stats.alive_usec, __ATOMIC_RELAXED);
+		started = __atomic_load_n(&worker->stats.started, __ATOMIC_RELAXED);
+		if (started && now > started) {
+			alive += now - started;
+		}
+		ws->busy_usec = (alive > ws->idle_usec) ? alive - ws->idle_usec : 0;
+
+		stats->jobs += ws->jobs;
+		for (b = 0; pool->timing && b < SPINDLE_STATS_BUCKETS; b++) {
+			stats->queue_wait[b] += __atomic_load_n(&worker->stats.queue_wait[b], __ATOMIC_RELAXED);
+			stats->run_time[b] += __atomic_load_n(&worker->stats.run_time[b], __ATOMIC_RELAXED);
+		}
+	}
+
+	stats->blocked = __atomic_load_n(&pool->blocked_waits, __ATOMIC_RELAXED);
+	stats->blocked_usec = __atomic_load_n(&pool->blocked_usec, __ATOMIC_RELAXED);
+	stats->expired = __atomic_load_n(&pool->expired, __ATOMIC_RELAXED);
+	stats->cancelled = __atomic_load_n(&pool->cancelled, __ATOMIC_RELAXED);
+	stats->queued = spindle_queue_get_posted(pool);
+
+	stats->tenants = __atomic_load_n(&pool->ntenants, __ATOMIC_ACQUIRE);
+	for (i = stats->tenants - 1; i >= 0; i--) {
+		tenant = pool->tenants[i];
+		ts = &stats->tenant[i];
+		memcpy(ts->name, tenant->name, SPINDLE_TENANT_NAME_SIZE);
+		ts->weight = tenant->weight;
+		ts->jobs = __atomic_load_n(&tenant->jobs, __ATOMIC_RELAXED);
+		if (i > 0) {
+			ts->queued = queue_get_posted(&tenant->queue);
+			ts->blocked = __atomic_load_n(&tenant->blocked_waits, __ATOMIC_RELAXED);
+			ts->blocked_usec = __atomic_load_n(&tenant->blocked_usec, __ATOMIC_RELAXED);
+			queued += ts->queued;
+		} else {
+			/* the pool's own queues */
+			ts->queued = (stats->queued > queued) ? stats->queued - queued : 0;
+			ts->blocked = stats->blocked;
+			ts->blocked_usec = stats->blocked_usec;
+		}
+	}
+
+	for (i = 0; i < pool->priorities; i++) {
+		peak = __atomic_load_n(&pool->job_queue[i].peak, __ATOMIC_RELAXED);
+		if (peak > stats->peak_queued) {
+			stats->peak_queued = peak;
+		}
+	}
+	for (i = 0; pool->nodes && i < pool->nnodes; i++) {
+		peak = __atomic_load_n(&pool->nodes[i].queue.peak, __ATOMIC_RELAXED);
+		if (peak > stats->peak_queued) {
+			stats->peak_queued = peak;
+		}
+	}
+
+	return 0;
 }
 /* }}} */
-#endif
 
-static void spindle_mutex_unlock_wrapper(void *data) /* {{{ */
+unsigned long spindle_stats_bucket_usec(int bucket) /* {{{ */
 {
-	pthread_mutex_t *mutex = (pthread_mutex_t *)data;
-	pthread_mutex_unlock(mutex);
+	int msb;
+
+	if (bucket < 4) {
+		return (bucket < 0) ? 0 : (unsigned long)bucket;
+	}
+	msb = (bucket >> 2) + 1;
+	return (1UL << msb) | ((unsigned long)(bucket & 3) << (msb - 2));
 }
 /* }}} */
 
-static void spindle_barrier_signal(spindle_barrier_t *b) /* {{{ */
+/* whether no job is running: every worker sleeps and no helper runs a job, see SPINDLE_QUIET_* for the rest.
+ * Workers leave spindle_park() before they take a job, so two scans finding the same number of jobs done
+ * around the look at the queues can't miss a job moving from a queue to a worker. Called with the mutex held */
+static int spindle_is_quiet(spindle_t *pool, int level) /* {{{ */
 {
-	pthread_mutex_lock(&b->mutex);
-	b->done_count++;
-	pthread_cond_signal(&b->var);
-	pthread_mutex_unlock(&b->mutex);
+	spindle_worker_t *worker;
+	unsigned long done[2];
+	int pass, i;
+
+	for (pass = 0; pass < 2; pass++) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		done[pass] = 0;
+		for (i = 0; i < pool->slots; i++) {
+			worker = pool->workers[i];
+			if (worker->state == SPINDLE_WORKER_RUNNING && __atomic_load_n(&worker->stats.parked, __ATOMIC_ACQUIRE) == 0) {
+				return 0;
+			}
+			done[pass] += __atomic_load_n(&worker->stats.jobs, __ATOMIC_RELAXED);
+		}
+		if (__atomic_load_n(&pool->foreign, __ATOMIC_ACQUIRE) > 0) {
+			return 0;
+		}
+		if (pass == 0 && level >= SPINDLE_QUIET_QUEUES && spindle_queue_get_posted(pool) > 0) {
+			return 0;
+		}
+		/* fibers waiting in their jobs, or woken up and not resumed yet */
+		if (pass == 0 && level >= SPINDLE_QUIET_ALL && __atomic_load_n(&pool->fibers_active, __ATOMIC_ACQUIRE) > 0) {
+			return 0;
+		}
+	}
+	return done[0] == done[1];
 }
 /* }}} */
 
-static void *th_do_work(void *data) /* {{{ */
+/* waits until the pool is quiet (see spindle_is_quiet()) or until abstime (may be NULL) */
+static int spindle_wait_quiet(spindle_t *pool, int level, const struct timespec *abstime) /* {{{ */
 {
-	spindle_t *pool = (spindle_t *)data; 
-	spindle_barrier_t *barrier;
-#ifdef SPINDLE_DEBUG
-	int myid = pool->live; /* this is wrong, but we need it only for debugging */
-#endif
-	
-	/* When we get a posted job, we copy it into these local vars */
-	spindle_job_func_t  myjob;
-	void        *myarg;  
-	spindle_job_func_t  mycleaner;
-	void        *mycleanarg;
+	volatile int ret = 0; /* set after pthread_cleanup_push(), which may be a setjmp() */
 
-	TP_DEBUG(pool, " >>> Thread[%d] starting, grabbing mutex.\n", myid);
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *) &pool->mutex);
+	/* the workers going idle from now on signal quiet */
+	__atomic_add_fetch(&pool->draining, 1, __ATOMIC_SEQ_CST);
+	while (!spindle_is_quiet(pool, level)) {
+		if (abstime == NULL) {
+			pthread_cond_wait(&pool->quiet, &pool->mutex);
+		} else if (ETIMEDOUT == pthread_cond_timedwait(&pool->quiet, &pool->mutex, abstime)) {
+			ret = spindle_is_quiet(pool, level) ? 0 : ETIMEDOUT;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&pool->draining, 1, __ATOMIC_SEQ_CST);
+	pthread_cleanup_pop(1);
+	return ret;
+}
+/* }}} */
 
-	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *)&pool->mutex);
+/* total of the jobs run by the workers of the pool and of its lanes */
+static unsigned long spindle_lanes_jobs(spindle_t *pool) /* {{{ */
+{
+	spindle_t *lane;
+	unsigned long jobs = 0;
+	int i, n, w;
 
-	/* Grab mutex so we can begin waiting for a job */
-	if (0 != pthread_mutex_lock(&pool->mutex)) {
-		return NULL;
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		lane = pool->lanes[i];
+		pthread_mutex_lock(&lane->mutex);
+		for (w = 0; w < lane->slots; w++) {
+			jobs += __atomic_load_n(&lane->workers[w]->stats.jobs, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&lane->mutex);
 	}
+	return jobs;
+}
+/* }}} */
 
-	/* Main loop: wait for job posting, do job(s) ... forever */
-	for( ; ; ) {
+/* waits until the pool and its lanes are all quiet at once: the jobs of a lane may dispatch to another one,
+ * so the lanes are waited for in turn until a pass finds nothing has run meanwhile */
+static int spindle_wait_lanes(spindle_t *pool, int level, const struct timespec *abstime) /* {{{ */
+{
+	spindle_t *lane;
+	unsigned long jobs;
+	int i, n, quiet, err;
 
-		TP_DEBUG(pool, " <<< Thread[%d] waiting for signal.\n", myid);
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	if (n == 1) {
+		return spindle_wait_quiet(pool, level, abstime);
+	}
 
-		/* only look for jobs if we're not in shutdown */
-		while(queue_is_job_available(pool->job_queue) == 0) {
-			pthread_cond_wait(&pool->job_posted, &pool->mutex);
+	for ( ; ; ) {
+		jobs = spindle_lanes_jobs(pool);
+		for (i = 0; i < n; i++) {
+			err = spindle_wait_quiet(pool->lanes[i], level, abstime);
+			if (err != 0) {
+				return err;
+			}
 		}
 
-		TP_DEBUG(pool, " >>> Thread[%d] received signal.\n", myid);
-
-		/* else execute all the jobs first */
-		queue_fetch_job(pool->job_queue, &barrier, &myjob, &myarg, &mycleaner, &mycleanarg);
-		if (myjob == (void *)-1) {
-			break;
+		quiet = 1;
+		for (i = 0; i < n && quiet; i++) {
+			lane = pool->lanes[i];
+			pthread_mutex_lock(&lane->mutex);
+			quiet = spindle_is_quiet(lane, level);
+			pthread_mutex_unlock(&lane->mutex);
 		}
-		pthread_cond_signal(&pool->job_taken);
-
-		TP_DEBUG(pool, " <<< Thread[%d] yielding mutex, taking job.\n", myid);
-
-		/* unlock mutex so other jobs can be posted */
-		if (0 != pthread_mutex_unlock(&pool->mutex)) {
-			return NULL;
+		if (quiet && spindle_lanes_jobs(pool) == jobs) {
+			return 0;
 		}
+	}
+}
+/* }}} */
 
-		/* Run the job we've taken */
-		if(mycleaner != NULL) {
-			pthread_cleanup_push(mycleaner,mycleanarg);
-			myjob(myarg);
-			pthread_cleanup_pop(1);
-		} else {
-			myjob(myarg);
-		}
+/* whether the current thread is a worker of the pool or of one of its lanes */
+static inline int spindle_in_pool(spindle_t *pool) /* {{{ */
+{
+	spindle_worker_t *self = spindle_current_worker;
 
-		TP_DEBUG(pool, " >>> Thread[%d] JOB DONE!\n", myid);
-		if (barrier) {
-			/* Job done! */
-			spindle_barrier_signal(barrier);
-		}
+	return self && (self->pool == pool || self->pool->parent == pool);
+}
+/* }}} */
 
-		/* Grab mutex so we can grab posted job, or (if no job is posted)
-		   begin waiting for next posting. */
-		if (0 != pthread_mutex_lock(&pool->mutex)) {
-			return NULL;
-		}
+int spindle_drain(spindle_t *pool, const struct timespec *abstime) /* {{{ */
+{
+	if (spindle_in_pool(pool)) {
+		return EDEADLK;
 	}
 
-	/* If we get here, we broke from loop because state is ALL_EXIT */
-	--pool->live;
+	return spindle_wait_lanes(pool, SPINDLE_QUIET_ALL, abstime);
+}
+/* }}} */
 
-	TP_DEBUG(pool, " <<< Thread[%d] exiting (signalling 'job_taken').\n", myid);
+int spindle_suspend(spindle_t *pool, const struct timespec *abstime) /* {{{ */
+{
+	int i, n, err;
 
-	/* We're not really taking a job ... but this signals the destroyer
-	   that one thread has exited, so it can keep on destroying. */
-	pthread_cond_signal(&pool->job_taken);
+	if (spindle_in_pool(pool)) {
+		return EDEADLK;
+	}
 
-	pthread_cleanup_pop(0);
-	pthread_mutex_unlock(&pool->mutex);
-	return NULL;
-}  
+	/* the workers finish their current job, then sleep until spindle_resume() */
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		__atomic_store_n(&pool->lanes[i]->suspended, 1, __ATOMIC_SEQ_CST);
+	}
+	for (i = 0; i < n; i++) {
+		err = spindle_wait_quiet(pool->lanes[i], SPINDLE_QUIET_IDLE, abstime);
+		if (err != 0) {
+			return err;
+		}
+	}
+	return 0;
+}
 /* }}} */
 
+void spindle_resume(spindle_t *pool) /* {{{ */
+{
+	int i, n;
+
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		__atomic_store_n(&pool->lanes[i]->suspended, 0, __ATOMIC_SEQ_CST);
+		spindle_wake_all(pool->lanes[i]);
+	}
+}
 /* }}} */
 
-spindle_t *spindle_create(int num_threads_in_pool) /* {{{ */
+/* turns new non-blocking dispatches away and stops the controller */
+static void spindle_stop_controller(spindle_t *pool) /* {{{ */
 {
-	return spindle_create_ex(num_threads_in_pool, 0);
+	pthread_mutex_lock(&pool->mutex);
+	__atomic_store_n(&pool->stopping, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&pool->control);
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (pool->max_size > pool->min_size) {
+		pthread_join(pool->controller, NULL);
+	}
 }
 /* }}} */
 
-spindle_t *spindle_create_ex(int num_threads_in_pool, int max_queue_size) /* {{{ */
+/* joins the worker threads (cancelling the running ones first if asked to) and frees the slots */
+static void spindle_free_workers(spindle_t *pool, int cancel) /* {{{ */
 {
-	spindle_t *pool;
+	spindle_worker_t *worker;
 	int i;
 
-	if (num_threads_in_pool <= 0) {
-		return NULL;
-	}
-
-	pool = (spindle_t *) malloc(sizeof(spindle_t));
-	if (pool == NULL) {
-		return NULL;
+	if (cancel) {
+		for (i = 0; i < pool->slots; i++) {
+			if (__atomic_load_n(&pool->workers[i]->state, __ATOMIC_RELAXED) == SPINDLE_WORKER_RUNNING) {
+				pthread_cancel(pool->workers[i]->thread);
+			}
+		}
+		/* sleeping workers are not cancellable, they check once they're awake */
+		spindle_wake_all(pool);
 	}
 
-	pthread_mutex_init(&(pool->mutex), NULL);
-	pthread_cond_init(&(pool->job_posted), NULL);
-	pthread_cond_init(&(pool->job_taken), NULL);
-	pool->size = num_threads_in_pool;
-	pool->job_queue = queue_create(num_threads_in_pool, max_queue_size);
-#ifdef SPINDLE_DEBUG
-	gettimeofday(&pool->created, NULL);
-#endif
-
-	pool->threads = (pthread_t *) malloc(pool->size * sizeof(pthread_t));
-	if (NULL == pool->threads) {
-		free(pool);
-		return NULL;
+	/* the workers still running may steal from the others, so they're all joined first */
+	for (i = 0; i < pool->slots; i++) {
+		worker = pool->workers[i];
+		if (__atomic_load_n(&worker->state, __ATOMIC_RELAXED) != SPINDLE_WORKER_FREE) {
+			pthread_join(worker->thread, NULL);
+		}
 	}
 
-	pool->live = 0;
-	for (i = 0; i < pool->size; i++) {
-		if (0 != pthread_create(pool->threads + i, NULL, th_do_work, (void *) pool)) {
-			free(pool->threads);
-			free(pool);
-			return NULL;
+	for (i = 0; i < pool->slots; i++) {
+		worker = pool->workers[i];
+		queue_free(&worker->mailbox);
+		free(worker->deque.jobs);
+#ifdef SPINDLE_HAVE_FIBERS
+		if (worker->fiber_cache) {
+			spindle_fiber_free(worker->fiber_cache);
 		}
-		pool->live++;
-		/* pthread_detach(pool->threads[i]); leave the threads joinable */
+#endif
+		free(worker);
 	}
-
-	TP_DEBUG(pool, " <<< Threadpool created with %d threads.\n", num_threads_in_pool);
-
-	return (spindle_t *)pool;
+	free(pool->workers);
+	pool->workers = NULL;
+	free(pool->parked);
+	pool->parked = NULL;
 }
 /* }}} */
 
-void spindle_dispatch_with_cleanup(spindle_t *from_me, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void * cleaner_arg) /* {{{ */
+/* frees the fibers of the pool once its workers are gone: the idle ones, and the ones
+ * whose jobs will never go on, which are dropped without unwinding their stacks */
+static void spindle_free_fibers(spindle_t *pool) /* {{{ */
 {
-	spindle_t *pool = (spindle_t *) from_me;
-	spindle_barrier_t *barrier_int = (spindle_barrier_t *)barrier;
-	
-	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *) &pool->mutex);
-	TP_DEBUG(pool, " >>> Dispatcher: grabbing mutex.\n");
+#ifdef SPINDLE_HAVE_FIBERS
+	spindle_fiber_t *fiber, **prev, *dropped = NULL;
+	int i;
 
-	if (0 != pthread_mutex_lock(&pool->mutex)) {
-		TP_DEBUG(pool, " >>> Dispatcher: failed to lock mutex!\n");
+	if (!pool->fibers) {
 		return;
 	}
 
-	while(!queue_can_accept_order(pool->job_queue)) {
-		TP_DEBUG(pool, " <<< Dispatcher: job queue full, %s\n", "signaling 'posted', waiting on 'taken'.");
-		pthread_cond_signal(&pool->job_posted);
-		pthread_cond_wait(&pool->job_taken, &pool->mutex);
+	/* a wakeup on a reused address must not find them */
+	if (__atomic_load_n(&pool->fibers_active, __ATOMIC_ACQUIRE) > 0) {
+		for (i = 0; i < SPINDLE_FIBER_BUCKETS; i++) {
+			spindle_spin_lock(&spindle_fiber_buckets[i].lock);
+			prev = &spindle_fiber_buckets[i].head;
+			while ((fiber = *prev) != NULL) {
+				if (fiber->pool == pool) {
+					*prev = fiber->next;
+					fiber->next = dropped;
+					dropped = fiber;
+					__atomic_sub_fetch(&spindle_fiber_sleepers, 1, __ATOMIC_SEQ_CST);
+				} else {
+					prev = &fiber->next;
+				}
+			}
+			spindle_spin_unlock(&spindle_fiber_buckets[i].lock);
+		}
+		while ((fiber = spindle_fiber_take_ready(pool)) != NULL) {
+			fiber->next = dropped;
+			dropped = fiber;
+		}
 	}
 
-	/* Finally, there's room to post a job. Do so and signal workers */
-	TP_DEBUG(pool, " <<< Dispatcher: posting job, signaling 'posted', yielding mutex\n");
-	queue_post_job(pool->job_queue, barrier_int, dispatch_to_here, arg, cleaner_func, cleaner_arg);
-
-	pthread_cond_signal(&pool->job_posted);
-
-	pthread_cleanup_pop(0);
-	/* unlock mutex so a worker can pick up the job */
-	pthread_mutex_unlock(&pool->mutex);
+	while ((fiber = dropped) != NULL) {
+		dropped = fiber->next;
+		spindle_fiber_free(fiber);
+	}
+	while ((fiber = pool->fiber_free) != NULL) {
+		pool->fiber_free = fiber->next;
+		spindle_fiber_free(fiber);
+	}
+#endif
 }
 /* }}} */
 
-void spindle_apply(spindle_t *p, spindle_apply_func_t func, void *arg) /* {{{ */
+/* lets the queued jobs of all the lanes run, since they may still dispatch to other lanes,
+ * then stops the workers of the pool from taking jobs of the lanes */
+static void spindle_lanes_settle(spindle_t *pool) /* {{{ */
 {
-	spindle_t *pool = (spindle_t *) p;
-	int i;
+	spindle_t *lane;
+	int i, n;
 
-	if (!func) {
+	n = __atomic_load_n(&pool->nlanes, __ATOMIC_ACQUIRE);
+	if (n == 1) {
 		return;
 	}
 
-	for (i = 0; i < pool->size; i++) {
-		func(pool->threads + i, i, arg);
+	for (i = 0; i < n; i++) {
+		__atomic_store_n(&pool->lanes[i]->suspended, 0, __ATOMIC_SEQ_CST);
+		spindle_wake_all(pool->lanes[i]);
 	}
+	spindle_wait_lanes(pool, SPINDLE_QUIET_QUEUES, NULL);
+
+	for (i = 1; i < n; i++) {
+		lane = pool->lanes[i];
+		/* the workers of the pool that have taken a job of the lane are waited for */
+		__atomic_store_n(&lane->spill, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&lane->mutex);
+		__atomic_add_fetch(&lane->draining, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&lane->foreign, __ATOMIC_SEQ_CST) > 0) {
+			pthread_cond_wait(&lane->quiet, &lane->mutex);
+		}
+		__atomic_sub_fetch(&lane->draining, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&lane->mutex);
+	}
+	__atomic_store_n(&pool->spill_lanes, 0, __ATOMIC_SEQ_CST);
 }
 /* }}} */
 
-int spindle_queue_get_posted(spindle_t *p) /* {{{ */
+/* destroys the lanes once the workers of the pool are gone: idle ones still peek at the queues of the lanes */
+static void spindle_lanes_destroy(spindle_t *pool) /* {{{ */
 {
-	spindle_t *pool = (spindle_t *) p;
-	int size;
+	int i;
 
-	if (0 != pthread_mutex_lock(&pool->mutex)) {
-		TP_DEBUG(pool, " >>> Dispatcher: failed to lock mutex!\n");
-		return -1;
+	for (i = 1; i < pool->nlanes; i++) {
+		spindle_destroy(pool->lanes[i]);
+		pool->lanes[i] = NULL;
 	}
-
-	size = pool->job_queue->posted;
-	pthread_mutex_unlock(&pool->mutex);
-
-	return size;
+	pool->nlanes = 1;
 }
 /* }}} */
 
 void spindle_destroy(spindle_t *destroyme) /* {{{ */
 {
 	spindle_t *pool = (spindle_t *) destroyme;
-	int oldtype, i;
+	int oldtype;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldtype);
-	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *) &pool->mutex); 
-
-	/* Cause all threads to exit. Because they were detached when created,
-	   the underlying memory for each is automatically reclaimed. */
-	TP_DEBUG(pool, " >>> Destroyer: grabbing mutex, posting exit job. Live = %d\n", pool->live);
-
-	if (0 != pthread_mutex_lock(&pool->mutex)) {
-		return;
-	}
-
-	while (pool->live > 0) {
-		TP_DEBUG(pool, " <<< Destroyer: signalling 'job_posted', waiting on 'job_taken'.\n");
-		queue_post_job(pool->job_queue, NULL, (spindle_job_func_t) -1, NULL, NULL, NULL);
-		/* get workers to check in ... */
-		pthread_cond_signal(&pool->job_posted);
-		/* ... and wake up when they check out */
-		pthread_cond_wait(&pool->job_taken, &pool->mutex);
-		TP_DEBUG(pool, " >>> Destroyer: received 'job_taken'. Live = %d\n", pool->live);
-	}
-
-	for(i = 0; i < pool->size; i++) {
-		pthread_cancel(pool->threads[i]);
-		pthread_join(pool->threads[i], NULL);
-	}
-
-	memset(pool->threads, 0, pool->size * sizeof(pthread_t));
-	free(pool->threads);
+	spindle_wheel_destroy(pool);
+	spindle_lanes_settle(pool);
 
-	TP_DEBUG(pool, " <<< Destroyer: releasing mutex prior to destroying it.\n");
-
-	pthread_cleanup_pop(0);  
-	if (0 != pthread_mutex_unlock(&pool->mutex)) {
-		return;
-	}
+	/* Tell all the workers at once: each one keeps running the pending jobs
+	   and exits as soon as it finds none, then they're joined */
+	TP_DEBUG(pool, " >>> Destroyer: stopping %d workers.\n", pool->live);
+	spindle_stop_controller(pool);
+	__atomic_store_n(&pool->suspended, 0, __ATOMIC_RELAXED);
+	spindle_wake_all(pool);
+	spindle_free_workers(pool, 0);
+	spindle_lanes_destroy(pool);
 
 	TP_DEBUG(pool, " --- Destroyer: destroying mutex.\n");
 
@@ -490,15 +5120,28 @@ void spindle_destroy(spindle_t *destroyme) /* {{{ */
 
 	TP_DEBUG(pool, " --- Destroyer: destroying conditional variables.\n");
 
-	if (0 != pthread_cond_destroy(&pool->job_posted)) {
+	if (0 != pthread_cond_destroy(&pool->job_taken)) {
 		return;
 	}
 
-	if (0 != pthread_cond_destroy(&pool->job_taken)) {
+	if (0 != pthread_cond_destroy(&pool->control)) {
+		return;
+	}
+
+	if (0 != pthread_cond_destroy(&pool->quiet)) {
 		return;
 	}
 
-	queue_destroy(pool->job_queue);
+	spindle_queues_destroy(pool->job_queue, pool->priorities);
+	spindle_nodes_destroy(pool);
+	spindle_completion_close(pool);
+	spindle_free_fibers(pool);
+	spindle_strands_destroy(pool);
+	spindle_tickets_destroy(pool);
+	spindle_tenants_destroy(pool);
+	spindle_thread_attr_free(pool->thread_attr);
+	spindle_slab_destroy(pool->future_slab);
+	free(pool->future_slab);
 	memset(pool, 0, sizeof(spindle_t));
 
 	free(pool);
@@ -510,32 +5153,43 @@ void spindle_destroy(spindle_t *destroyme) /* {{{ */
 void spindle_destroy_immediately(spindle_t *destroymenow) /* {{{ */
 {
 	spindle_t *pool = (spindle_t *) destroymenow;
-	int oldtype,i;
+	int oldtype, i;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldtype);
+	spindle_wheel_destroy(pool);
+	spindle_stop_controller(pool);
 
-	pthread_cleanup_push(spindle_mutex_unlock_wrapper, (void *) &pool->mutex);
-	pthread_mutex_lock(&pool->mutex);
-
+	/* no locking here: a worker cancelled in pthread_cond_wait() needs the mutex to leave it */
+	spindle_free_workers(pool, 1);
 
-	for(i = 0; i < pool->size; i++) {
-		pthread_cancel(pool->threads[i]);
-		pthread_join(pool->threads[i], NULL);
+	/* nobody takes their jobs any more */
+	for (i = 1; i < pool->nlanes; i++) {
+		spindle_destroy_immediately(pool->lanes[i]);
 	}
 
 	TP_DEBUG(pool, " --- Destroyer: destroying mutex.\n");
 
-	pthread_cleanup_pop(0);
-
 	if (0 != pthread_mutex_destroy(&pool->mutex)) {
 		TP_DEBUG(pool, " --- failed to destroy mutex: %s (%d)\n", strerror(errno), errno);
 	}
 
 	TP_DEBUG(pool, " --- Destroyer: destroying conditional variables.\n");
 
-	pthread_cond_destroy(&pool->job_posted);
 	pthread_cond_destroy(&pool->job_taken);
-	
+	pthread_cond_destroy(&pool->control);
+	pthread_cond_destroy(&pool->quiet);
+
+	/* the jobs still queued are dropped */
+	spindle_queues_destroy(pool->job_queue, pool->priorities);
+	spindle_nodes_destroy(pool);
+	spindle_completion_close(pool);
+	spindle_free_fibers(pool);
+	spindle_strands_destroy(pool);
+	spindle_tickets_destroy(pool);
+	spindle_tenants_destroy(pool);
+	spindle_thread_attr_free(pool->thread_attr);
+	spindle_slab_destroy(pool->future_slab);
+	free(pool->future_slab);
 	memset(pool, 0, sizeof(spindle_t));
 	free(pool);
 	pool = NULL;
@@ -553,10 +5207,7 @@ spindle_barrier_t *spindle_barrier_create(void) /* {{{ */
 		return NULL;
 	}
 
-	pthread_mutex_init(&barrier->mutex, NULL);
-	pthread_cond_init(&barrier->var, NULL);
-	barrier->posted_count = 0;
-	barrier->done_count = 0;
+	barrier->pending = 0;
 	return (spindle_barrier_t *)barrier;
 }
 /* }}} */
@@ -565,21 +5216,117 @@ int spindle_barrier_start(spindle_barrier_t *b) /* {{{ */
 {
 	spindle_barrier_t *barrier = (spindle_barrier_t *)b;
 
-	barrier->posted_count = 0;
-	barrier->done_count = 0;
+	__atomic_store_n(&barrier->pending, 0, __ATOMIC_SEQ_CST);
+	return 0;
+}
+/* }}} */
+
+/* sleeps until all the jobs of the barrier are done or until abstime (may be NULL), returns ETIMEDOUT on timeout */
+static int spindle_barrier_sleep(spindle_barrier_t *barrier, const struct timespec *abstime) /* {{{ */
+{
+	int pending;
+
+	pending = __atomic_load_n(&barrier->pending, __ATOMIC_ACQUIRE);
+	while ((pending & ~SPINDLE_BARRIER_WAITERS) != 0) {
+		/* let the last job know there's somebody to wake up */
+		if (!(pending & SPINDLE_BARRIER_WAITERS)) {
+			if (!__atomic_compare_exchange_n(&barrier->pending, &pending, pending | SPINDLE_BARRIER_WAITERS, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			pending |= SPINDLE_BARRIER_WAITERS;
+		}
+		if (ETIMEDOUT == spindle_wait_word(&barrier->pending, pending, abstime)) {
+			pending = __atomic_load_n(&barrier->pending, __ATOMIC_ACQUIRE);
+			return ((pending & ~SPINDLE_BARRIER_WAITERS) != 0) ? ETIMEDOUT : 0;
+		}
+		pending = __atomic_load_n(&barrier->pending, __ATOMIC_ACQUIRE);
+	}
 	return 0;
 }
 /* }}} */
 
+/* number of spindle_barrier_help() calls the thread is in */
+static __thread int spindle_help_depth = 0;
+
+/* runs jobs of the pool until all the jobs of the barrier are done, so that the waiting thread
+ * keeps its CPU busy and nested fork-join can't leave every worker waiting for jobs nobody runs */
+static void spindle_barrier_help(spindle_t *pool, spindle_barrier_t *barrier) /* {{{ */
+{
+	spindle_worker_t *self;
+	struct timespec abstime;
+	spindle_job_t job;
+	int got;
+
+#ifdef SPINDLE_HAVE_FIBERS
+	/* a fiber just steps aside, its worker runs the other jobs anyway */
+	if (spindle_fiber_self()) {
+		spindle_barrier_sleep(barrier, NULL);
+		return;
+	}
+#endif
+	if (spindle_help_depth >= SPINDLE_HELP_MAX_DEPTH) {
+		spindle_barrier_sleep(barrier, NULL);
+		return;
+	}
+	spindle_help_depth++;
+
+	self = spindle_current_worker;
+	if (self && self->pool != pool) {
+		self = NULL;
+	}
+
+	while ((__atomic_load_n(&barrier->pending, __ATOMIC_ACQUIRE) & ~SPINDLE_BARRIER_WAITERS) != 0) {
+		got = 0;
+		if (!__atomic_load_n(&pool->suspended, __ATOMIC_RELAXED)) {
+			if (self) {
+				got = spindle_get_job(self, &job);
+			} else {
+				/* counted before the queues are empty, so that spindle_drain() waits for the job */
+				__atomic_add_fetch(&pool->foreign, 1, __ATOMIC_SEQ_CST);
+				got = spindle_fetch_foreign(pool, &job);
+				if (!got) {
+					__atomic_sub_fetch(&pool->foreign, 1, __ATOMIC_SEQ_CST);
+					spindle_signal_quiet(pool);
+				}
+			}
+		}
+		if (!got) {
+			/* the jobs posted meanwhile don't wake us up, so look again from time to time */
+			pthread_testcancel();
+			spindle_abstime(&abstime, SPINDLE_HELP_POLL_USEC);
+			spindle_barrier_sleep(barrier, &abstime);
+			continue;
+		}
+
+		if (self) {
+			spindle_worker_run(self, &job);
+		} else {
+			spindle_run_job(&job);
+			__atomic_sub_fetch(&pool->foreign, 1, __ATOMIC_SEQ_CST);
+			spindle_signal_quiet(pool);
+		}
+	}
+
+	spindle_help_depth--;
+	spindle_barrier_sleep(barrier, NULL);
+}
+/* }}} */
+
 void spindle_barrier_wait(spindle_barrier_t *b) /* {{{ */
 {
-	spindle_barrier_t *barrier = (spindle_barrier_t *)b;
+	spindle_worker_t *self = spindle_current_worker;
 
-	pthread_mutex_lock(&barrier->mutex);
-	while (barrier->done_count < barrier->posted_count) {
-		pthread_cond_wait(&barrier->var, &barrier->mutex);
+	if (self && self->pool->help_wait) {
+		spindle_barrier_help(self->pool, b);
+	} else {
+		spindle_barrier_sleep(b, NULL);
 	}
-	pthread_mutex_unlock(&barrier->mutex);
+}
+/* }}} */
+
+void spindle_barrier_wait_help(spindle_t *pool, spindle_barrier_t *b) /* {{{ */
+{
+	spindle_barrier_help(pool, b);
 }
 /* }}} */
 
@@ -587,8 +5334,6 @@ void spindle_barrier_destroy(spindle_barrier_t *b) /* {{{ */
 {
 	spindle_barrier_t *barrier = (spindle_barrier_t *)b;
 
-	pthread_mutex_destroy(&barrier->mutex);
-	pthread_cond_destroy(&barrier->var);
 	free(barrier);
 	b = NULL;
 }
@@ -22,55 +22,232 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 /* general purpose job function */
 typedef void (*spindle_job_func_t)(void *);
 
+/* task function for spindle_submit(), its return value is the result of the future */
+typedef void *(*spindle_task_func_t)(void *);
+
+/* range function for spindle_parallel_for(), processes iterations [begin, end) */
+typedef void (*spindle_range_func_t)(long begin, long end, void *arg);
+
 /* thread apply function, first argument is a pointer to pthread_t */
 typedef void (*spindle_apply_func_t)(void *thread, int thread_num, void *arg);
 
-typedef struct _spindle_queue_node_t spindle_queue_node_t;
+typedef struct _spindle_queue_head_t spindle_queue_head_t;
+typedef struct _spindle_worker_t spindle_worker_t;
+typedef struct _spindle_slab_t spindle_slab_t;
+typedef struct _spindle_future_t spindle_future_t;
+typedef struct _spindle_graph_t spindle_graph_t;
+typedef struct _spindle_task_t spindle_task_t;
+typedef struct _spindle_node_t spindle_node_t;
+typedef struct _spindle_timer_t spindle_timer_t;
+typedef struct _spindle_wheel_t spindle_wheel_t;
+typedef struct _spindle_fiber_t spindle_fiber_t;
+typedef struct _spindle_strands_t spindle_strands_t;
+typedef struct _spindle_ticket_t spindle_ticket_t;
+typedef struct _spindle_tenant_t spindle_tenant_t;
+typedef struct _spindle_thread_attr_t spindle_thread_attr_t;
+
+/* maximum number of threads allowed in a pool */
+#define SPINDLE_MAX_IN_POOL 200
+
+/* job schedulers */
+#define SPINDLE_SCHED_SHARED   0 /* all workers share a single job queue (default) */
+#define SPINDLE_SCHED_STEALING 1 /* per-worker deques, external jobs go to the shared queue, idle workers steal */
+
+/* job queue ordering */
+#define SPINDLE_QUEUE_FIFO 0 /* oldest job first (default) */
+#define SPINDLE_QUEUE_LIFO 1 /* newest job first */
+
+/* jobs waiting for longer than this are taken before the jobs of higher priority levels */
+#define SPINDLE_DEFAULT_AGING_USEC 100000
+
+/* idle workers above the minimum exit after this long */
+#define SPINDLE_DEFAULT_LINGER_USEC 2000000
+
+/* idle workers look for jobs this many times with a pause in between, then this many times yielding the CPU, then sleep */
+#define SPINDLE_DEFAULT_SPIN_COUNT  1000
+#define SPINDLE_DEFAULT_YIELD_COUNT 4
+
+/* maximum number of lanes of a pool, the pool itself included */
+#define SPINDLE_MAX_LANES 8
+
+/* maximum number of tenants of a pool, the pool's own queues (tenant 0) included, and their largest weight */
+#define SPINDLE_MAX_TENANTS 16
+#define SPINDLE_MAX_WEIGHT  1000
+#define SPINDLE_TENANT_NAME_SIZE 32
+
+/* stack size of the fibers, see spindle_attr_t.fibers */
+#define SPINDLE_DEFAULT_FIBER_STACK_SIZE 65536
 
-typedef struct _spindle_queue_head_t
-{
-	spindle_queue_node_t *head;
-	spindle_queue_node_t *tail;
-	spindle_queue_node_t *free_head;
-	spindle_queue_node_t *free_tail;
-	int capacity;
-	int max_capacity;
-	int posted;
-} spindle_queue_head_t;
+/* longest worker name the system keeps, see spindle_attr_t.name */
+#define SPINDLE_THREAD_NAME_MAX 15
+
+/* pool attributes, initialize with spindle_attr_init() */
+typedef struct _spindle_attr_t {
+	int scheduler;      /* SPINDLE_SCHED_* */
+	int queue_order;    /* SPINDLE_QUEUE_* */
+	int priorities;     /* number of priority levels, 1..16, level 0 is the highest */
+	int aging_usec;     /* starvation limit for the lower priority levels, 0 disables aging */
+	int min_threads;    /* lower bound of an elastic pool, 0 means the initial number of threads */
+	int max_threads;    /* upper bound of an elastic pool, 0 means the initial number of threads (fixed size pool) */
+	int linger_usec;    /* idle workers above min_threads exit after this long, 0 keeps them forever */
+	int grow_threshold; /* an elastic pool grows only while more jobs than this are waiting */
+	int numa;           /* 1 to group the workers by NUMA node, each node gets its own queue */
+	int timing;         /* 1 to time every job for the latency histograms of spindle_stats_get() */
+	int spin_count;     /* idle workers spin this many times before they yield ... */
+	int yield_count;    /* ... and yield this many times before they sleep, both 0 put them to sleep right away */
+	int help_wait;      /* 1 to have workers waiting for a barrier run jobs of the pool meanwhile, 0 (default) to have them sleep */
+	int fibers;         /* 1 to run the jobs on fibers that give the worker back while they wait */
+	int fiber_stack_size; /* stack size of the fibers in bytes, rounded up to pages */
+	int spill;          /* lanes only: 1 to let the workers of the pool take the jobs of the lane when they have nothing else */
+	int stack_size;     /* stack size of the workers in bytes, 0 for the system default (usually 8MB) */
+	int guard_size;     /* guard area below the stacks in bytes, -1 for the system default */
+	int lock_stack;     /* 1 to mlock() the stacks of the workers, backed by huge pages where the system allows it */
+	int sched_policy;   /* SCHED_* of <sched.h>, SCHED_OTHER with priority 0 (default) inherits the creator's scheduling */
+	int sched_priority;
+	const char *cpus;   /* CPUs the workers may run on, a list like "2-5,8", NULL for any */
+	int pin;            /* 1 to pin every worker to a single CPU of cpus, in turn */
+	const char *name;   /* names of the workers, "%d" stands for the worker index (e.g. "io-%d"), cut to SPINDLE_THREAD_NAME_MAX characters */
+} spindle_attr_t;
+
+/* most argument bytes spindle_dispatch_copy() can store in the job itself */
+#define SPINDLE_INLINE_ARG_SIZE 64
+
+/* a job description for spindle_dispatch_batch() */
+typedef struct _spindle_batch_job_t {
+	spindle_job_func_t func;
+	void *arg;
+	spindle_job_func_t cleanup_func;
+	void *cleanup_arg;
+} spindle_batch_job_t;
+
+/* a finished task harvested by spindle_reap() */
+typedef struct _spindle_completion_t {
+	spindle_future_t *future;    /* the handle returned by spindle_submit_completion(), still to be released */
+	void *result;                /* the return value of the task */
+} spindle_completion_t;
+
+/* number of latency histogram buckets: 4 per power of two, see spindle_stats_bucket_usec() */
+#define SPINDLE_STATS_BUCKETS 124
+
+typedef struct _spindle_worker_stats_t {
+	int running;                 /* 0 if the worker has exited (elastic pools) */
+	unsigned long jobs;          /* jobs executed */
+	unsigned long busy_usec;     /* time spent running or looking for jobs */
+	unsigned long idle_usec;     /* time spent spinning or sleeping */
+	unsigned long steals;        /* jobs stolen from other workers */
+	unsigned long wakeups;       /* times the worker was woken up to look for jobs */
+} spindle_worker_stats_t;
+
+typedef struct _spindle_tenant_stats_t {
+	char name[SPINDLE_TENANT_NAME_SIZE];
+	int weight;
+	int queued;                  /* jobs waiting now */
+	unsigned long jobs;          /* jobs taken by the workers since the first tenant was created */
+	unsigned long blocked;       /* times a dispatcher had to wait for a free slot */
+	unsigned long blocked_usec;  /* time the dispatchers spent waiting */
+} spindle_tenant_stats_t;
+
+/* pool statistics, filled by spindle_stats_get() */
+typedef struct _spindle_stats_t {
+	int workers;                                     /* number of entries in worker[], indexed like in spindle_apply() */
+	spindle_worker_stats_t worker[SPINDLE_MAX_IN_POOL];
+	unsigned long jobs;                              /* jobs executed by all the workers */
+	unsigned long queue_wait[SPINDLE_STATS_BUCKETS]; /* time from dispatch to start, only with attr->timing */
+	unsigned long run_time[SPINDLE_STATS_BUCKETS];   /* time the jobs ran, only with attr->timing */
+	unsigned long blocked;                           /* times a dispatcher had to wait for a free slot */
+	unsigned long blocked_usec;                      /* time the dispatchers spent waiting */
+	unsigned long expired;                           /* jobs dropped because their deadline had passed */
+	unsigned long cancelled;                         /* jobs dropped by spindle_cancel() */
+	int queued;                                      /* jobs waiting now, see spindle_queue_get_posted() */
+	int peak_queued;                                 /* most jobs seen waiting in a single queue (sampled) */
+	int tenants;                                     /* number of entries in tenant[], 0 if the pool has no tenants */
+	spindle_tenant_stats_t tenant[SPINDLE_MAX_TENANTS];
+} spindle_stats_t;
+
+/* set in spindle_barrier_t.pending when somebody is sleeping in spindle_barrier_wait() */
+#define SPINDLE_BARRIER_WAITERS 0x40000000
 
 typedef struct _spindle_barrier_t {
-	pthread_mutex_t mutex;
-	pthread_cond_t var;
-	volatile int posted_count;
-	volatile int done_count;
+	volatile int pending; /* number of unfinished jobs | SPINDLE_BARRIER_WAITERS, updated atomically */
 } spindle_barrier_t;
 
 typedef struct _spindle_t {
 #ifdef SPINDLE_DEBUG
 	struct timeval  created;    /* When the threadpool was created.*/
 #endif
-	pthread_t      *threads;       /* The threads themselves.*/
+	spindle_worker_t **workers; /* The threads themselves, allocated on first use and kept until the pool is destroyed */
+	int             slots;      /* Number of worker slots ever used, only grows */
+	int             scheduler;  /* SPINDLE_SCHED_* */
+	volatile int    idle;       /* Number of workers spinning or sleeping, updated atomically */
+	volatile int    spinning;   /* Number of workers spinning for jobs, updated atomically */
+	volatile int    skipped;    /* Wakeups the dispatchers left to the spinners, updated atomically */
+	int             spin_count; /* Idle workers spin this many times ... */
+	int             yield_count;  /* ... then yield this many times before they sleep */
+	int             max_spinning; /* Most workers spinning at once, 0 if they don't spin */
+	int             help_wait;  /* Workers run jobs while waiting for a barrier */
+	volatile int    parked_lock;  /* Spin lock protecting parked and nparked */
+	int             nparked;    /* Number of workers sleeping on their own futex */
+	spindle_worker_t **parked;  /* The sleeping workers, the most recently idle last */
+	volatile int    blocked;    /* Number of dispatchers waiting for a free slot on job_taken, updated atomically */
+	volatile int    slots_freed; /* Bumped when a full queue with blocked dispatchers takes jobs again, fibers sleep on it */
 	pthread_mutex_t mutex;      /* protects all vars declared below.*/
-	int             size;       /* Number of threads in the pool*/
+	int             size;       /* Number of running workers */
 	int             live;       /* Number of live threads in pool (when pool is being destroyed, live<=size) */
+	int             target;     /* Number of workers the pool is heading to, the excess ones exit after their current job */
+	int             min_size;
+	int             max_size;
+	unsigned long   linger;     /* Idle worker retirement time in usec */
+	int             grow_threshold;
+	int             stopping;   /* Set once the pool is being destroyed, the controller and the idle workers exit */
+	volatile int    suspended;  /* Set by spindle_suspend(), the workers don't take jobs */
+	volatile int    draining;   /* Number of threads waiting for the pool to be quiet, updated atomically */
+	volatile int    foreign;    /* Number of jobs run by threads helping in spindle_barrier_wait_help(), updated atomically */
+	pthread_cond_t  quiet;      /* Signalled by the workers going idle while somebody is draining */
+	int             completion_fd;  /* Readable while completions are pending, -1 until first used */
+	int             completion_wfd; /* Where the workers write to make it readable (a pipe without eventfd) */
+	volatile int    completion_signalled; /* Set once completion_fd has been made readable, updated atomically */
+	volatile int    reap_lock;  /* Spin lock protecting reaped */
+	spindle_future_t *completed;  /* Finished tasks pushed by the workers, the latest first */
+	spindle_future_t *reaped;     /* Finished tasks taken over by spindle_reap(), the oldest first */
+	spindle_wheel_t *wheel;     /* Delayed and periodic jobs, allocated on first use */
+	spindle_strands_t *strands; /* Jobs of spindle_dispatch_keyed() by key, allocated on first use */
+	spindle_slab_t  *ticket_slab; /* Jobs with a deadline or a handle, allocated on first use */
+	spindle_thread_attr_t *thread_attr; /* Attributes of the worker threads, NULL for the defaults */
+	spindle_tenant_t *tenants[SPINDLE_MAX_TENANTS]; /* Submission queues of spindle_dispatch_tenant(), [0] stands for the pool's own ones */
+	volatile int    ntenants;   /* Number of entries in tenants, 0 until the first one is created, only grows */
+	unsigned long   tenant_vtime; /* Virtual time of the fair scheduler, the pass of the last tenant served */
+	int             fibers;     /* Run the jobs on fibers */
+	size_t          fiber_stack_size;
+	volatile int    fiber_lock; /* Spin lock protecting the fiber lists */
+	spindle_fiber_t *fiber_free;  /* Fibers done with their job, ready for the next one */
+	spindle_fiber_t *ready_head;  /* Fibers woken up, waiting for a worker to resume them */
+	spindle_fiber_t *ready_tail;
+	volatile int    nready;     /* Number of fibers on the ready list, updated atomically */
+	volatile int    fibers_active;  /* Number of fibers running a job or waiting in one, updated atomically */
+	struct _spindle_t *parent;  /* Lanes only: the pool the lane belongs to */
+	struct _spindle_t *lanes[SPINDLE_MAX_LANES]; /* Lanes of the pool, [0] is the pool itself */
+	volatile int    nlanes;     /* Number of entries in lanes, only grows */
+	volatile int    spill;      /* Lanes only: the workers of the parent take the jobs of the lane when idle */
+	volatile int    spill_lanes;  /* Number of lanes spilling over to the workers of this pool */
+	pthread_t       controller; /* Elastic pools only: adjusts the target */
+	pthread_cond_t  control;    /* Wakes up the controller */
 
-	pthread_cond_t  job_posted; /* dispatcher: "Hey guys, there's a job!"*/
 	pthread_cond_t  job_taken;  /* a worker: "Got it!"*/
 
-	spindle_queue_head_t      *job_queue;      /* queue of work orders*/
+	int             priorities; /* Number of priority levels */
+	unsigned long   aging;      /* Starvation limit in usec */
+	spindle_queue_head_t      *job_queue;      /* queues of work orders, one per priority level */
+	spindle_slab_t            *future_slab;    /* recycled future handles */
+	int             nnodes;     /* Number of NUMA nodes, 1 unless the pool is NUMA-aware */
+	spindle_node_t  *nodes;     /* NUMA-aware pools only: node-local queues */
+	int             *cpu_node;  /* NUMA-aware pools only: node of each CPU */
+	int             timing;     /* Time the jobs for the statistics */
+	unsigned long   blocked_waits;  /* Times a dispatcher waited for a free slot, updated atomically */
+	unsigned long   blocked_usec;   /* Time the dispatchers spent waiting, updated atomically */
+	unsigned long   expired;    /* Jobs dropped at their deadline, updated atomically */
+	unsigned long   cancelled;  /* Jobs dropped by spindle_cancel(), updated atomically */
 } spindle_t;
 
-struct _spindle_queue_node_t
-{
-  spindle_job_func_t func_to_dispatch;
-  void *func_arg;
-  spindle_job_func_t cleanup_func;
-  void *cleanup_arg;
-  spindle_barrier_t *barrier;
-  spindle_queue_node_t *next;
-  spindle_queue_node_t *prev;
-};
-
 #define SPINDLE_DEFAULT_MAX_QUEUE_SIZE 65536
 
 /**
@@ -80,14 +257,74 @@ struct _spindle_queue_node_t
  */
 spindle_t *spindle_create(int num_threads_in_pool);
 
+/**
+ * Same as spindle_create(), but allows to set max queue size.
+ * The queue is a preallocated ring buffer, its size is rounded up to a power of two.
+ */
 spindle_t *spindle_create_ex(int num_threads_in_pool, int max_queue_size);
 
+/**
+ * Same as spindle_create_ex(), but also takes pool attributes (see spindle_attr_t).
+ * attr may be NULL, which is equivalent to calling spindle_create_ex().
+ *
+ * If max_threads is above min_threads, the pool is elastic: a controller thread watches it
+ * and starts new workers while jobs keep waiting and every worker is busy.
+ * Workers that spend most of their time blocked (on I/O, locks etc.) get company right away,
+ * otherwise the size is adjusted step by step, following the throughput (hill climbing).
+ * Idle workers above min_threads exit after linger_usec.
+ * No pool may have more than 200 threads.
+ *
+ * With attr->numa the workers are spread over the NUMA nodes listed in /sys/devices/system/node
+ * (worker i goes to node i % pool->nnodes) and pinned to their CPUs. Each node gets its own queue,
+ * allocated on the node: spindle_dispatch() posts to the node the caller is running on,
+ * workers take the jobs of their own node first and prefer stealing from their neighbours.
+ * On single node machines the attribute has no effect.
+ *
+ * With attr->fibers the jobs run on fibers, stacks of attr->fiber_stack_size bytes (default 64KB,
+ * plus a guard page) recycled from job to job. A job waiting for a barrier or a future, or calling
+ * spindle_yield(), only suspends its fiber: the worker goes on with the other jobs and the fiber is
+ * resumed, before new jobs are taken, once it can go on. Fibers may be resumed by another worker,
+ * so a job must not keep thread-local data (errno included) or hold locks across those calls.
+ * Timed waits still block the worker, jobs with a cleanup function run on the worker's stack.
+ * Fibers still waiting when the pool is destroyed are dropped without returning.
+ * Creating the pool fails if the platform has no ucontext.
+ *
+ * The stack, guard and scheduling attributes apply to every worker thread the pool starts;
+ * if the system refuses them (e.g. a real-time policy without the privilege), creating the pool
+ * fails and errno tells why. CPUs (they take precedence over attr->numa), names and locked stacks
+ * are set up by each worker before it takes its first job, as far as the system allows
+ * (CPUs that are offline or out of the cpuset, RLIMIT_MEMLOCK...).
+ */
+spindle_t *spindle_create_with_attr(int num_threads_in_pool, int max_queue_size, const spindle_attr_t *attr);
+
+/**
+ * Initializes pool attributes with the default values.
+ */
+void spindle_attr_init(spindle_attr_t *attr);
+
+/**
+ * Sets the number of workers.
+ * A fixed size pool just gets the new size, an elastic pool clamps n to [min_threads, max_threads]
+ * and keeps adjusting its size from there.
+ * New workers are started right away, the excess ones exit after finishing their current job.
+ * Returns 0 on success, EINVAL if n is out of 1..200 or the error of pthread_create().
+ */
+int spindle_resize(spindle_t *pool, int n);
+
 /**
  * Sends a thread off to do some work.  If all threads in the pool are busy, dispatch will
  * block until a thread becomes free and is dispatched.
  *
  * Once a thread is dispatched, this function returns immediately.
  *
+ * Jobs dispatched from within a pool worker never block: while the queue is full,
+ * the dispatching worker runs the queued jobs of the pool itself until the new one fits,
+ * and runs the new job right away only if there's nothing it may take (e.g. the pool is suspended).
+ * That holds for spindle_dispatch_batch() and spindle_dispatch_tenant() too, but not for
+ * spindle_try_dispatch() and spindle_dispatch_timed(), which fail as they do in any other thread.
+ * With SPINDLE_SCHED_STEALING such jobs go to that worker's own deque first,
+ * other workers steal them when idle.
+ *
  * Also enables the user to define cleanup handlers in
  * cases of immediate cancel.  The cleanup handler function (cleaner_func) is
  * executed automatically with cleaner_arg as the argument after the
@@ -102,14 +339,316 @@ void spindle_dispatch_with_cleanup(spindle_t *from_me, spindle_barrier_t *barrie
  */
 #define spindle_dispatch(from, barrier, to, arg) spindle_dispatch_with_cleanup((from), (barrier), (to), (arg), NULL, NULL)
 
+/**
+ * Non-blocking spindle_dispatch(): returns 0 if the job has been queued,
+ * EAGAIN if the queue is full and ESHUTDOWN if the pool is being destroyed.
+ * A full queue takes new jobs again only once it has drained to 3/4 of its size.
+ */
+int spindle_try_dispatch(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg);
+
+/**
+ * Same as spindle_dispatch(), but waits for a free slot only until abstime (CLOCK_REALTIME, like pthread_cond_timedwait()).
+ * Returns 0 if the job has been queued, ETIMEDOUT or ESHUTDOWN otherwise.
+ * Unlike spindle_dispatch(), a worker of the pool waits as well (until abstime at most), it doesn't run any jobs meanwhile.
+ */
+int spindle_dispatch_timed(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, const struct timespec *abstime);
+
+/**
+ * Same as spindle_dispatch(), but copies len bytes of data (up to SPINDLE_INLINE_ARG_SIZE) into the job itself,
+ * the job function gets a pointer to that copy (aligned like a long), which is valid until it returns.
+ * That saves allocating and freeing an argument struct for every job.
+ * Returns 0 or EINVAL if len is too big.
+ */
+int spindle_dispatch_copy(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, const void *data, size_t len);
+
+/**
+ * Posts the job to the queue of the given NUMA node (0..pool->nnodes - 1), blocking like spindle_dispatch().
+ * Workers of other nodes take such jobs only when they have nothing else to do.
+ * Returns 0 or EINVAL if there's no such node.
+ */
+int spindle_dispatch_on_node(spindle_t *pool, int node, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg);
+
+/**
+ * Posts the job to the given worker (the index passed to spindle_apply() callbacks), nobody else runs it.
+ * That's a hint: if there is no such worker or it has too many jobs already, the job is dispatched
+ * to the worker's node (or to the pool) as usual.
+ * Returns 0 or EINVAL if the index is out of range.
+ */
+int spindle_dispatch_to_worker(spindle_t *pool, int worker_id, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg);
+
+/**
+ * Adds a lane to the pool: a class of workers of its own, with num_threads workers, a queue of
+ * max_queue_size jobs and the attributes of attr (may be NULL), like spindle_create_with_attr().
+ * Blocking jobs (I/O, DNS...) get a lane of their own, so that they don't hold up the others.
+ * With attr->spill the workers of the pool take jobs of the lane when they have nothing else to do.
+ * The pool itself is lane 0, spindle_drain(), spindle_suspend(), spindle_resume() and spindle_destroy()
+ * apply to all of its lanes. Lanes can't have lanes.
+ * Returns the number of the new lane (1..SPINDLE_MAX_LANES - 1), or -1 on failure.
+ */
+int spindle_lane_create(spindle_t *pool, int num_threads, int max_queue_size, const spindle_attr_t *attr);
+
+/**
+ * Returns the handle of the lane (0 is the pool itself), NULL if there's no such lane.
+ * Every function taking a pool works on it (spindle_submit(), spindle_stats_get(), spindle_resize()...),
+ * except spindle_destroy*() and spindle_lane_create().
+ */
+spindle_t *spindle_lane_get(spindle_t *pool, int lane);
+
+/**
+ * Posts the job to the queue of the lane, blocking like spindle_dispatch().
+ * Returns 0 or EINVAL if there's no such lane.
+ */
+int spindle_dispatch_lane(spindle_t *pool, int lane, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg);
+
+/**
+ * Adds a tenant to the pool: a submission queue of its own, of max_queue_size jobs (0 for the default size),
+ * served in proportion to weight (1..SPINDLE_MAX_WEIGHT) while several tenants have jobs waiting.
+ * The pool's own queues, where all the other dispatch functions post, are tenant 0, of weight 1.
+ * A full tenant queue blocks only the dispatchers of that tenant. name is for the statistics.
+ * Returns the tenant (1..SPINDLE_MAX_TENANTS - 1), or -1 and sets errno (EINVAL, EAGAIN if there
+ * are too many tenants, ENOMEM).
+ */
+int spindle_tenant_create(spindle_t *pool, const char *name, int weight, int max_queue_size);
+
+/**
+ * Posts the job to the queue of the tenant, blocking like spindle_dispatch() while that queue is full.
+ * With SPINDLE_SCHED_STEALING the job still goes to the tenant's queue, not to the worker's deque.
+ * Returns 0 or EINVAL if there's no such tenant.
+ */
+int spindle_dispatch_tenant(spindle_t *pool, int tenant, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg);
+
+/**
+ * Same as spindle_dispatch_with_cleanup(), but the job is dropped if it hasn't started by deadline
+ * (CLOCK_REALTIME, like pthread_cond_timedwait()): the worker that comes across it runs only
+ * cleaner_func (if any) and counts it in the barrier, so stale jobs cost next to nothing during
+ * an overload. Waits for a free slot only until the deadline.
+ * Returns 0 if the job has been queued, ETIMEDOUT, ENOMEM or ESHUTDOWN otherwise.
+ */
+int spindle_dispatch_deadline(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg, const struct timespec *deadline);
+
+/**
+ * Same as spindle_dispatch_deadline() (deadline may be NULL), but returns a handle to cancel the job,
+ * or NULL and sets errno. The handle has to be given back exactly once, by spindle_cancel() or
+ * spindle_ticket_release(), before the pool is destroyed.
+ */
+spindle_ticket_t *spindle_dispatch_cancellable(spindle_t *pool, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg, const struct timespec *deadline);
+
+/**
+ * Drops the job if it hasn't started yet and gives the handle back. Returns 0 if the job won't run:
+ * its cleaner_func has been run by the caller and it is counted in the barrier. Returns EALREADY
+ * if the job has started (or has been dropped at its deadline) already.
+ */
+int spindle_cancel(spindle_ticket_t *ticket);
+
+/**
+ * Gives the handle back, leaving the job queued.
+ */
+void spindle_ticket_release(spindle_ticket_t *ticket);
+
+/**
+ * Posts the job to the strand of key: jobs of the same key run one at a time, in the order they
+ * were dispatched, jobs of different keys run in parallel. While a job of the key runs the next ones
+ * wait in the strand rather than in the queue, so they don't hold up any worker, and the worker
+ * that finishes one goes on with the next (up to 16 in a row, then the strand queues up again).
+ * That replaces a lock per key taken by the jobs themselves. Blocks like spindle_dispatch() when
+ * the strand has to be queued. Returns 0 or ENOMEM.
+ */
+int spindle_dispatch_keyed(spindle_t *pool, unsigned long key, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg);
+
+/**
+ * Same as spindle_dispatch_with_cleanup(), but posts the job to the given priority level.
+ * Level 0 is the highest one and is used by spindle_dispatch(), levels beyond
+ * attr->priorities - 1 are clamped. Jobs of a lower level that have been waiting
+ * for longer than attr->aging_usec are taken before the higher level ones.
+ */
+void spindle_dispatch_prio_with_cleanup(spindle_t *pool, int prio, spindle_barrier_t *barrier, spindle_job_func_t dispatch_to_here, void *arg, spindle_job_func_t cleaner_func, void *cleaner_arg);
+
+#define spindle_dispatch_prio(from, prio, barrier, to, arg) spindle_dispatch_prio_with_cleanup((from), (prio), (barrier), (to), (arg), NULL, NULL)
+
+/**
+ * Dispatches n jobs at once, same as calling spindle_dispatch_with_cleanup() for each of them,
+ * but the queue slots are reserved in bulk, the barrier is updated once and
+ * only as many workers are woken up as there are jobs.
+ * Blocks while the queue is full, just like spindle_dispatch().
+ */
+void spindle_dispatch_batch(spindle_t *pool, spindle_barrier_t *barrier, const spindle_batch_job_t *jobs, int n);
+
+/**
+ * Runs body over [begin, end) in parallel and returns when all of the iterations are done.
+ * Instead of a job per chunk, one job per worker is posted and every participant,
+ * including the calling thread, keeps claiming chunks of at least grain iterations
+ * until the range is exhausted. Chunks shrink towards the end of the range.
+ */
+void spindle_parallel_for(spindle_t *pool, long begin, long end, long grain, spindle_range_func_t body, void *arg);
+
+/**
+ * Submits a task and returns a handle to wait for its result, NULL on failure.
+ * The handle has to be released with spindle_future_release() before the pool is destroyed.
+ * Handles are recycled, so submitting a task doesn't allocate memory in the long run.
+ */
+spindle_future_t *spindle_submit(spindle_t *pool, spindle_task_func_t func, void *arg);
+
+/**
+ * Waits for the task to finish and returns its result.
+ * On a fiber (see spindle_attr_t.fibers) only the fiber waits, the worker goes on with other jobs.
+ */
+void *spindle_future_wait(spindle_future_t *f);
+
+/* the name of spindle_future_wait() in fiber code */
+#define spindle_await(f) spindle_future_wait(f)
+
+/**
+ * Lets the other jobs run: on a fiber, the job is queued again behind the jobs already waiting
+ * and the worker takes the next one. Elsewhere, it yields the CPU.
+ */
+void spindle_yield(void);
+
+/**
+ * Stores the result of the task in *result and returns 0 if the task has finished,
+ * returns EAGAIN otherwise. Never blocks.
+ */
+int spindle_future_try_get(spindle_future_t *f, void **result);
+
+/**
+ * Same as spindle_future_wait(), but gives up at abstime (CLOCK_REALTIME, like pthread_cond_timedwait()).
+ * Returns 0 and stores the result of the task in *result, or returns ETIMEDOUT.
+ */
+int spindle_future_get_timed(spindle_future_t *f, const struct timespec *abstime, void **result);
+
+/**
+ * Releases the handle, the result can't be retrieved after that.
+ * It's fine to release a handle of a task that hasn't finished yet.
+ */
+void spindle_future_release(spindle_future_t *f);
+
+/**
+ * Same as spindle_submit(), but once the task has finished its handle and result are also
+ * queued for spindle_reap(), and spindle_completion_fd() becomes readable.
+ * Returns NULL on failure (no memory, or errno of eventfd() on first use).
+ */
+spindle_future_t *spindle_submit_completion(spindle_t *pool, spindle_task_func_t func, void *arg);
+
+/**
+ * Returns a file descriptor that polls readable while finished tasks of spindle_submit_completion()
+ * wait to be reaped, for epoll/poll/select loops. Only read by spindle_reap(), never read it directly.
+ * It belongs to the pool and is closed by spindle_destroy(). Returns -1 and sets errno on failure.
+ */
+int spindle_completion_fd(spindle_t *pool);
+
+/**
+ * Takes up to max finished tasks (the oldest first) and stores them in out, never blocks.
+ * Returns the number of completions stored, which may be 0 after a spurious wakeup.
+ * The fd stays readable while completions are left. Each out[i].future still has to be released.
+ */
+int spindle_reap(spindle_t *pool, spindle_completion_t *out, int max);
+
+/**
+ * Schedules func(arg) to run once the task behind f has finished and returns its future.
+ * The first continuation is run by the same worker right after the task, the others are dispatched.
+ * The returned handle has to be released just like the one returned by spindle_submit().
+ */
+spindle_future_t *spindle_then(spindle_future_t *f, spindle_task_func_t func, void *arg);
+
+/**
+ * Dispatches func(arg) once delay_usec have passed and returns a handle to cancel it, NULL on failure.
+ * Timers are kept in a hierarchical timing wheel with a resolution of 1 msec, so arming and
+ * cancelling them costs O(1) no matter how many are pending; a single timer thread started on
+ * first use moves the due ones to the queue. The handle has to be given back exactly once,
+ * by spindle_timer_cancel() or spindle_timer_release(), before the pool is destroyed.
+ */
+spindle_timer_t *spindle_dispatch_after(spindle_t *pool, unsigned long delay_usec, spindle_job_func_t func, void *arg);
+
+/**
+ * Same as spindle_dispatch_after(), but dispatches func(arg) every period_usec until the timer is cancelled.
+ * The runs are kept at a fixed rate, runs missed while the pool was busy are skipped, and a run
+ * may overlap the previous one if func takes longer than the period. EINVAL if period_usec is 0.
+ */
+spindle_timer_t *spindle_dispatch_every(spindle_t *pool, unsigned long period_usec, spindle_job_func_t func, void *arg);
+
+/**
+ * Disarms the timer and gives the handle back. Returns 0 if the timer won't fire anymore
+ * (a run that is due right now may still be dispatched), EALREADY if a one-shot timer has fired already.
+ */
+int spindle_timer_cancel(spindle_timer_t *timer);
+
+/**
+ * Gives the handle back, leaving the timer armed.
+ */
+void spindle_timer_release(spindle_timer_t *timer);
+
+/**
+ * Creates an empty task graph.
+ */
+spindle_graph_t *spindle_graph_create(spindle_t *pool);
+
+/**
+ * Adds a task to the graph, returns NULL on failure.
+ */
+spindle_task_t *spindle_graph_add(spindle_graph_t *graph, spindle_job_func_t func, void *arg);
+
+/**
+ * Declares that task can't start before predecessor has finished.
+ * Returns 0 on success, EINVAL or ENOMEM otherwise.
+ */
+int spindle_graph_depend(spindle_task_t *task, spindle_task_t *predecessor);
+
+/**
+ * Dispatches the tasks without predecessors, the workers take care of the rest:
+ * the first task that becomes ready is run by the worker that finished its last predecessor,
+ * the others are dispatched from there. Every dispatched job is counted in the barrier (may be NULL)
+ * until it and the tasks run after it are done, so wait on it before running the graph again or destroying it.
+ * Returns 0 on success, EDEADLK if the graph has a cycle or ENOMEM.
+ */
+int spindle_graph_run(spindle_graph_t *graph, spindle_barrier_t *barrier);
+
+/**
+ * Destroys the graph and all of its tasks.
+ */
+void spindle_graph_destroy(spindle_graph_t *graph);
+
+/**
+ * Collects the statistics of the pool without locking anything: every worker keeps its own counters.
+ * The numbers are not a consistent snapshot, but each of them is accurate on its own.
+ * Returns 0.
+ */
+int spindle_stats_get(spindle_t *pool, spindle_stats_t *stats);
+
+/**
+ * Returns the lower bound (in usec) of a latency histogram bucket, the upper bound is the lower bound of the next one.
+ * Buckets 0..3 hold 0..3 usec, then every power of two is split into four buckets, the last one holds everything above.
+ */
+unsigned long spindle_stats_bucket_usec(int bucket);
+
 /**
  * Apply a function to all threads in the pool.
  * */
 void spindle_apply(spindle_t *p, spindle_apply_func_t func, void *arg);
 
+/**
+ * Waits until every queued job has been run and the workers are idle, or until abstime (NULL waits forever).
+ * Dispatching goes on meanwhile, jobs posted by other threads during the wait may be waited for or not.
+ * Returns 0 once the pool is quiet, ETIMEDOUT on timeout, EDEADLK if called from a worker of the pool.
+ */
+int spindle_drain(spindle_t *pool, const struct timespec *abstime);
+
+/**
+ * Stops the workers from taking jobs without destroying them, e.g. around fork() or a config reload.
+ * Jobs may still be dispatched, they wait in the queues. Returns 0 once the jobs already running
+ * have finished and every worker sleeps, ETIMEDOUT if abstime (may be NULL) passes first, in which case
+ * the pool stays suspended and the remaining jobs finish on their own. EDEADLK if called from a worker of the pool.
+ */
+int spindle_suspend(spindle_t *pool, const struct timespec *abstime);
+
+/**
+ * Lets the workers take jobs again after spindle_suspend().
+ */
+void spindle_resume(spindle_t *pool);
+
 /**
  * Kills the threadpool, causing all threads in it to commit suicide,
  * and then frees all the memory associated with the threadpool.
+ * The queued jobs are run first (a suspended pool is resumed), then all the workers are
+ * told to exit at once and joined, so the cost doesn't grow with a handshake per worker.
  */
 void spindle_destroy(spindle_t *destroyme);
 
@@ -118,7 +657,7 @@ void spindle_destroy(spindle_t *destroyme);
  * It is potentially dangerous to use with libraries that are not specifically
  * asynchronous cancel thread safe. Also, without cleanup handlers, any dynamic
  * memory or system resource in use could potentially be left without a reference
- * to it.
+ * to it. The jobs still queued are dropped.
  */
 void spindle_destroy_immediately(spindle_t *destroymenow);
 
@@ -134,9 +673,19 @@ int spindle_barrier_start(spindle_barrier_t *b);
 
 /**
  * Waits for the threads to finish their jobs and continues after all of the workers have finished.
+ * Pool workers created with attr->help_wait run jobs of their pool while waiting, see spindle_barrier_wait_help().
  */
 void spindle_barrier_wait(spindle_barrier_t *b);
 
+/**
+ * Same as spindle_barrier_wait(), but the caller runs queued jobs of the pool until all the jobs
+ * of the barrier are done, and sleeps only when there's nothing to run.
+ * Jobs waiting for nested barriers this way can't leave the pool without a worker to run their sub-jobs.
+ * The jobs run on the caller's stack, so don't call it while holding a lock those jobs may take.
+ * Waits nested more than 32 deep (a job helping while it waits for a job helping ...) just sleep.
+ */
+void spindle_barrier_wait_help(spindle_t *pool, spindle_barrier_t *b);
+
 /**
  * Destroys and frees the barrier internal struct.
  */
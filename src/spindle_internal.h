@@ -13,13 +13,361 @@ You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-/* maximum number of threads allowed in a pool */
-#define SPINDLE_MAX_IN_POOL 200
 #define MAX_QUEUE_MEMORY_SIZE 65536
 
+/* elastic pools: the controller samples the pool this often */
+#define SPINDLE_CONTROL_INTERVAL_USEC 20000
+/* ... and grows it once the backlog has been there for this many samples in a row */
+#define SPINDLE_GROW_SAMPLES 3
+
+/* a full queue accepts jobs again once it has drained to 3/4 of its size */
+#define SPINDLE_LOW_WATER(high) ((high) - (high) / 4)
+
+/* maximum number of NUMA nodes a pool can spread over */
+#define SPINDLE_MAX_NODES 64
+
+/* size of the per-worker queue of spindle_dispatch_to_worker() */
+#define SPINDLE_MAILBOX_SIZE 64
+
+/* maximum number of priority levels */
+#define SPINDLE_MAX_PRIORITIES 16
+
+/* size of the per-worker deque used by the work-stealing scheduler, must be a power of two */
+#define SPINDLE_DEQUE_SIZE 1024
+
+#define SPINDLE_CACHELINE_SIZE 64
+#define SPINDLE_CACHELINE_ALIGNED __attribute__((aligned(SPINDLE_CACHELINE_SIZE)))
+
 #ifdef SPINDLE_DEBUG
 # define TP_DEBUG(pool, ...) etfprintf((pool)->created, stderr, __VA_ARGS__);
 #else
 # define TP_DEBUG(pool, ...)
 #endif
 
+/* slab allocator for fixed size objects that are recycled on the hot path,
+ * objects are never returned to the system until the slab is destroyed */
+#define SPINDLE_SLAB_BLOCK 256
+#define SPINDLE_SLAB_MAX_BLOCKS 4096
+
+/* every slab object starts with this header */
+typedef struct _spindle_slab_obj_t {
+	unsigned int next;  /* free list link, index + 1 */
+	unsigned int index;
+} spindle_slab_obj_t;
+
+typedef struct _spindle_slab_t {
+	unsigned long free_top SPINDLE_CACHELINE_ALIGNED; /* tagged free list top, see stack_push() */
+	size_t obj_size;
+	int nblocks;
+	pthread_mutex_t grow_mutex;
+	char *blocks[SPINDLE_SLAB_MAX_BLOCKS];
+} spindle_slab_t;
+
+/* the fields of a job the queue slots keep */
+#define SPINDLE_JOB_FIELDS \
+	spindle_job_func_t func; \
+	void *arg; \
+	spindle_job_func_t cleanup_func; \
+	void *cleanup_arg; \
+	spindle_barrier_t *barrier; \
+	unsigned long queued; /* enqueue time in usec, set only when there are several priority levels */ \
+	int len;              /* spindle_dispatch_copy(): number of bytes in data, func gets a pointer to them instead of arg */
+
+typedef struct _spindle_job_head_t {
+	SPINDLE_JOB_FIELDS
+} spindle_job_head_t;
+
+/* the argument bytes of a job, the queues keep them next to the slots so that the slots stay small */
+typedef struct _spindle_job_args_t {
+	unsigned long data[SPINDLE_INLINE_ARG_SIZE / sizeof(unsigned long)];
+} spindle_job_args_t;
+
+/* a job as it is passed around and stored in the deques, starts with the same fields as spindle_job_head_t */
+typedef struct _spindle_job_t {
+	SPINDLE_JOB_FIELDS
+	unsigned long data[SPINDLE_INLINE_ARG_SIZE / sizeof(unsigned long)];
+} spindle_job_t;
+
+/* a slot of the job queue ring, padded so that neighbour slots don't share cache lines */
+typedef struct _spindle_queue_slot_t {
+	unsigned long seq;
+	spindle_job_head_t job;
+} SPINDLE_CACHELINE_ALIGNED spindle_queue_slot_t;
+
+/* bounded lock-free MPMC queue, either a FIFO ring or a LIFO stack built on the same slots */
+struct _spindle_queue_head_t {
+	spindle_queue_slot_t *slots;
+	spindle_job_args_t *args;       /* argument bytes of the jobs, indexed like slots, touched only by spindle_dispatch_copy() jobs */
+	unsigned long mask;             /* number of slots - 1 */
+	int max_capacity;               /* requested size, the ring is rounded up to a power of two */
+	int order;                      /* SPINDLE_QUEUE_* */
+	int high_water;                 /* the queue is closed once it holds that many jobs (max_capacity) ... */
+	int low_water;                  /* ... and reopened once it drains to that many */
+	volatile int full;              /* closed, updated atomically */
+	int peak;                       /* highest number of jobs seen in the queue, sampled */
+	unsigned long enqueue_pos SPINDLE_CACHELINE_ALIGNED; /* LIFO: number of jobs pushed */
+	unsigned long dequeue_pos SPINDLE_CACHELINE_ALIGNED; /* LIFO: number of jobs popped */
+	unsigned long job_top SPINDLE_CACHELINE_ALIGNED;     /* LIFO: stack of posted jobs */
+	unsigned long free_top SPINDLE_CACHELINE_ALIGNED;    /* LIFO: stack of free slots */
+} SPINDLE_CACHELINE_ALIGNED;
+
+/* bounded Chase-Lev deque: the owner pushes and pops at the bottom, thieves steal from the top */
+typedef struct _spindle_deque_t {
+	long top SPINDLE_CACHELINE_ALIGNED;
+	long bottom SPINDLE_CACHELINE_ALIGNED;
+	spindle_job_t *jobs;     /* SPINDLE_DEQUE_SIZE slots, allocated only in work-stealing pools */
+} spindle_deque_t;
+
+/* statistics of a worker slot, written by its worker only (relaxed atomic stores), read by spindle_stats_get() */
+typedef struct _spindle_counters_t {
+	unsigned long jobs;
+	unsigned long steals;
+	unsigned long wakeups;
+	unsigned long idle_usec;
+	unsigned long alive_usec;  /* lifetime of the threads that have exited */
+	unsigned long started;     /* start time of the current thread, 0 if there's none */
+	unsigned long parked;      /* start time of the current sleep, 0 if the worker is awake */
+	unsigned long queue_wait[SPINDLE_STATS_BUCKETS];
+	unsigned long run_time[SPINDLE_STATS_BUCKETS];
+} SPINDLE_CACHELINE_ALIGNED spindle_counters_t;
+
+/* how quiet spindle_is_quiet() wants the pool */
+#define SPINDLE_QUIET_IDLE   0 /* no job running */
+#define SPINDLE_QUIET_QUEUES 1 /* ... and none queued */
+#define SPINDLE_QUIET_ALL    2 /* ... and no fiber waiting in one */
+
+/* threads helping in spindle_barrier_wait_help() look for new jobs this often while they sleep */
+#define SPINDLE_HELP_POLL_USEC 1000
+
+/* barrier waits a thread may nest while helping, the deeper ones just sleep, so that the stack can't overflow */
+#define SPINDLE_HELP_MAX_DEPTH 32
+
+/* the queue depth is sampled once per this many posted jobs (must be a power of two) and when a queue is full */
+#define SPINDLE_PEAK_SAMPLE 16
+
+/* worker slot states */
+#define SPINDLE_WORKER_FREE    0 /* never used or joined */
+#define SPINDLE_WORKER_RUNNING 1
+#define SPINDLE_WORKER_EXITED  2 /* the thread has exited, but hasn't been joined yet */
+
+struct _spindle_worker_t {
+	pthread_t thread;
+	spindle_t *pool;
+	int id;
+	int state;               /* SPINDLE_WORKER_*, protected by the pool mutex */
+	unsigned int seed;       /* steal victim selection */
+	int node;                /* NUMA node, 0 unless the pool is NUMA-aware */
+	volatile int wake;       /* futex word the worker sleeps on, set by whoever wakes it up */
+	int parked_at;           /* index in pool->parked, -1 unless sleeping, protected by pool->parked_lock */
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+	clockid_t cpu_clock;
+	unsigned long cpu_usec;  /* CPU time at the last controller sample */
+#endif
+	spindle_counters_t stats;
+	spindle_deque_t deque;
+	spindle_queue_head_t mailbox; /* jobs for this worker only, see spindle_dispatch_to_worker() */
+#ifdef SPINDLE_HAVE_FIBERS
+	ucontext_t fiber_ctx;    /* the worker's own stack while it runs a fiber */
+	spindle_fiber_t *fiber_cache; /* a free fiber kept for the next job */
+	void (*fiber_action)(spindle_fiber_t *fiber); /* run on the worker stack once the fiber has switched away */
+#endif
+} SPINDLE_CACHELINE_ALIGNED;
+
+/* copied from spindle_attr_t, so that the caller's strings may go away */
+struct _spindle_thread_attr_t {
+	pthread_attr_t attr;     /* stack, guard and scheduling, every worker is started with it */
+	int lock_stack;
+	int pin;
+	int ncpus;               /* 0 unless attr->cpus was given */
+#ifdef SPINDLE_HAVE_NUMA
+	cpu_set_t cpus;
+#endif
+	char name[64];           /* the pattern, "" for no name */
+};
+
+struct _spindle_node_t {
+	spindle_queue_head_t queue; /* jobs dispatched on the node, allocated there */
+#ifdef SPINDLE_HAVE_NUMA
+	cpu_set_t cpus;
+#endif
+};
+
+/* helper jobs spindle_parallel_for() posts at a time, they're kept on the caller's stack (maybe a fiber's) */
+#define SPINDLE_PFOR_BATCH 16
+
+/* shared state of a spindle_parallel_for() call */
+typedef struct _spindle_pfor_t {
+	long next SPINDLE_CACHELINE_ALIGNED;      /* start of the unclaimed part of the range */
+	long remaining SPINDLE_CACHELINE_ALIGNED; /* iterations not completed yet */
+	int refcount;
+	long end;
+	long grain;
+	int participants;
+	spindle_range_func_t body;
+	void *arg;
+	spindle_barrier_t barrier;                /* signalled once remaining drops to zero */
+} spindle_pfor_t;
+
+#define SPINDLE_FUTURE_DONE    0x1
+#define SPINDLE_FUTURE_WAITERS 0x2
+
+/* marks the list of continuations of a finished future */
+#define SPINDLE_FUTURE_CLOSED ((spindle_future_t *)1)
+
+struct _spindle_future_t {
+	spindle_slab_obj_t slab;
+	volatile int state;  /* SPINDLE_FUTURE_* flags, futex word */
+	int refcount;        /* the submitter and the job */
+	spindle_t *pool;
+	spindle_task_func_t func;
+	void *arg;
+	void *result;
+	spindle_future_t *continuations; /* added by spindle_then(), SPINDLE_FUTURE_CLOSED once done */
+	spindle_future_t *next;          /* next continuation of the same future, or next completion once done */
+	int notify;                      /* queued for spindle_reap() once done */
+};
+
+#ifdef SPINDLE_HAVE_FIBERS
+/* a job running on its own stack, so that it can wait without holding the worker */
+struct _spindle_fiber_t {
+	ucontext_t ctx;
+	spindle_t *pool;
+	spindle_worker_t *worker;   /* running it at the moment */
+	void *stack;                /* mapping of stack_size bytes, the lowest page is a guard */
+	size_t stack_size;
+	int done;                   /* the job has returned */
+	volatile int *wait_addr;    /* spindle_fiber_wait(): the word it sleeps on ... */
+	int wait_val;               /* ... while it holds this value */
+	spindle_fiber_t *next;      /* free, ready or sleeper list */
+	spindle_job_t job;
+};
+
+#endif
+
+/* the pass of a tenant advances by SPINDLE_STRIDE / weight for every job taken from its queue,
+ * the workers serve the tenant with the lowest pass (stride scheduling) */
+#define SPINDLE_STRIDE (1UL << 20)
+
+struct _spindle_tenant_t {
+	spindle_queue_head_t queue;  /* unused for tenant 0, whose jobs are in the pool's own queues */
+	char name[SPINDLE_TENANT_NAME_SIZE];
+	int weight;
+	unsigned long stride;
+	pthread_cond_t taken;        /* a worker: "Got one of yours!", signalled with the pool mutex held */
+	unsigned long pass SPINDLE_CACHELINE_ALIGNED; /* updated atomically */
+	unsigned long jobs;          /* updated atomically, like the rest of the line */
+	volatile int blocked;        /* number of dispatchers waiting on taken */
+	unsigned long blocked_waits;
+	unsigned long blocked_usec;
+} SPINDLE_CACHELINE_ALIGNED;
+
+/* states of a job with a ticket */
+#define SPINDLE_TICKET_QUEUED  0
+#define SPINDLE_TICKET_STARTED 1
+#define SPINDLE_TICKET_DROPPED 2 /* cancelled or expired */
+
+/* a job with a deadline or a handle: the queue holds a job running spindle_ticket_run() on it,
+ * so that the queue slots don't grow for the jobs that have neither */
+struct _spindle_ticket_t {
+	spindle_slab_obj_t slab;
+	int state;               /* SPINDLE_TICKET_*, changed by compare and swap */
+	int refcount;            /* the queue, and the handle if there is one */
+	spindle_t *pool;
+	spindle_job_func_t func;
+	void *arg;
+	spindle_job_func_t cleanup_func;
+	void *cleanup_arg;
+	spindle_barrier_t *barrier;
+	unsigned long deadline;  /* CLOCK_REALTIME in usec, 0 if there's none */
+};
+
+/* strands of spindle_dispatch_keyed(), hashed by key */
+#define SPINDLE_STRAND_BUCKETS 1024
+/* jobs a strand runs in a row before it goes back to the end of the queue */
+#define SPINDLE_STRAND_BATCH 16
+
+typedef struct _spindle_strand_job_t {
+	spindle_slab_obj_t slab;
+	spindle_job_func_t func;
+	void *arg;
+	spindle_barrier_t *barrier;
+	struct _spindle_strand_job_t *next;
+} spindle_strand_job_t;
+
+/* a key with jobs, kept in its bucket until the last one is done */
+typedef struct _spindle_strand_t {
+	spindle_slab_obj_t slab;
+	spindle_t *pool;
+	unsigned long key;
+	int bucket;
+	spindle_strand_job_t *head;   /* the job running (or about to run) ... */
+	spindle_strand_job_t *tail;   /* ... and the ones waiting behind it */
+	struct _spindle_strand_t *next;
+} spindle_strand_t;
+
+struct _spindle_strands_t {
+	spindle_slab_t strand_slab;
+	spindle_slab_t job_slab;
+	struct {
+		volatile int lock;    /* spin lock protecting the strands of the bucket and their jobs */
+		spindle_strand_t *head;
+	} SPINDLE_CACHELINE_ALIGNED buckets[SPINDLE_STRAND_BUCKETS];
+};
+
+/* timing wheel: SPINDLE_WHEEL_LEVELS levels of 64 slots, a slot of level n spans 64^n ticks,
+ * timers further away than the whole wheel are parked in the last level until they get closer */
+#define SPINDLE_WHEEL_BITS   6
+#define SPINDLE_WHEEL_SLOTS  (1 << SPINDLE_WHEEL_BITS)
+#define SPINDLE_WHEEL_LEVELS 5
+#define SPINDLE_WHEEL_SPAN   (1UL << (SPINDLE_WHEEL_BITS * SPINDLE_WHEEL_LEVELS))
+#define SPINDLE_TIMER_TICK_USEC 1000
+
+typedef struct _spindle_timer_link_t {
+	struct _spindle_timer_link_t *next;
+	struct _spindle_timer_link_t *prev;
+} spindle_timer_link_t;
+
+struct _spindle_timer_t {
+	spindle_timer_link_t link;  /* slot list, must be first */
+	spindle_t *pool;
+	spindle_job_func_t func;
+	void *arg;
+	unsigned long expires;      /* tick */
+	unsigned long period;       /* in ticks, 0 if the timer fires once */
+	int level;                  /* -1 if the timer isn't in the wheel */
+	int slot;
+	int refcount;               /* the handle, and the wheel while the timer is armed or being dispatched */
+	spindle_timer_t *due;       /* list of the timers dispatched by the current run */
+};
+
+struct _spindle_wheel_t {
+	pthread_mutex_t mutex;      /* protects everything below */
+	pthread_cond_t wake;        /* wakes the timer thread up */
+	pthread_t thread;
+	int stopping;
+	unsigned long start;        /* spindle_clock_usec() at tick 0 */
+	unsigned long now;          /* next tick to run */
+	unsigned long sleep_until;  /* tick the timer thread sleeps until, 0 while it's running */
+	unsigned long count;        /* timers in the wheel */
+	unsigned long long occupied[SPINDLE_WHEEL_LEVELS]; /* non-empty slots */
+	spindle_timer_link_t slots[SPINDLE_WHEEL_LEVELS][SPINDLE_WHEEL_SLOTS];
+};
+
+struct _spindle_task_t {
+	spindle_graph_t *graph;
+	spindle_job_func_t func;
+	void *arg;
+	int ndeps;               /* number of predecessors */
+	int pending;             /* predecessors not finished yet, updated atomically during the run */
+	int nsucc;
+	int succ_size;
+	spindle_task_t **succ;   /* tasks depending on this one */
+	spindle_task_t *next;    /* list of the tasks of the graph */
+};
+
+struct _spindle_graph_t {
+	spindle_t *pool;
+	spindle_barrier_t *barrier;
+	spindle_task_t *tasks;
+	int ntasks;
+};
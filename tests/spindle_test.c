@@ -0,0 +1,484 @@
+/*
+libspindle behaviour tests, run with "make check".
+
+Covers the paths where a race or a lost wakeup would show: barrier reuse,
+cancelling jobs while the workers take them, strand ordering, timer
+ordering and cancellation, suspend/resume/drain, resizing a busy pool
+and workers dispatching to their own full queue. Every test runs with
+both schedulers where that makes a difference. A test that hangs is
+caught by an alarm, the exit code is the number of failed checks.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <spindle.h>
+
+/* the whole run is killed after this many seconds */
+#define TEST_TIMEOUT_SEC 300
+
+#define TEST_KEYS     8
+#define TEST_KEY_JOBS 2000
+#define TEST_TIMERS   32
+
+static int test_failed = 0;
+static const char *test_scheduler = "";
+
+#define TEST_CHECK(cond) test_check((cond), #cond, __func__, __LINE__)
+
+static void test_check(int ok, const char *what, const char *func, int line) /* {{{ */
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL %s (%s), line %d: %s\n", func, test_scheduler, line, what);
+		test_failed++;
+	}
+}
+/* }}} */
+
+static void test_abstime(struct timespec *ts, unsigned long usec) /* {{{ */
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+/* }}} */
+
+static spindle_t *test_pool(int scheduler, int workers, int max_queue_size, int fibers) /* {{{ */
+{
+	spindle_attr_t attr;
+	spindle_t *pool;
+
+	spindle_attr_init(&attr);
+	attr.scheduler = scheduler;
+	attr.fibers = fibers;
+	pool = spindle_create_with_attr(workers, max_queue_size, &attr);
+	if (pool == NULL) {
+		fprintf(stderr, "spindle_test: failed to create a pool of %d workers\n", workers);
+		exit(1);
+	}
+	return pool;
+}
+/* }}} */
+
+static void test_count_job(void *arg) /* {{{ */
+{
+	__atomic_add_fetch((long *)arg, 1, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+/* one barrier for many rounds: every wait must see exactly the jobs of its round */
+static void test_barrier_reuse(int scheduler) /* {{{ */
+{
+	spindle_t *pool = test_pool(scheduler, 4, 0, 0);
+	spindle_barrier_t *b = spindle_barrier_create();
+	long count;
+	int round, i;
+
+	for (round = 0; round < 500; round++) {
+		count = 0;
+		spindle_barrier_start(b);
+		for (i = 0; i < round % 64 + 1; i++) {
+			spindle_dispatch(pool, b, test_count_job, &count);
+		}
+		spindle_barrier_wait(b);
+		TEST_CHECK(__atomic_load_n(&count, __ATOMIC_RELAXED) == round % 64 + 1);
+	}
+	spindle_barrier_destroy(b);
+	spindle_destroy(pool);
+}
+/* }}} */
+
+typedef struct _test_cancel_t {
+	long ran;
+	long cleaned;
+} test_cancel_t;
+
+static void test_cancel_job(void *arg) /* {{{ */
+{
+	__atomic_add_fetch(&((test_cancel_t *)arg)->ran, 1, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+static void test_cancel_cleanup(void *arg) /* {{{ */
+{
+	__atomic_add_fetch(&((test_cancel_t *)arg)->cleaned, 1, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+/* cancelling races with the workers taking the jobs: each job either runs or is dropped, never both */
+static void test_cancel_race(int scheduler) /* {{{ */
+{
+	spindle_t *pool = test_pool(scheduler, 4, 0, 0);
+	spindle_barrier_t *b = spindle_barrier_create();
+	spindle_ticket_t *tickets[1000];
+	test_cancel_t t = {0, 0};
+	long cancelled = 0, started = 0;
+	int round, i;
+
+	for (round = 0; round < 20; round++) {
+		spindle_barrier_start(b);
+		for (i = 0; i < 1000; i++) {
+			tickets[i] = spindle_dispatch_cancellable(pool, b, test_cancel_job, &t, test_cancel_cleanup, &t, NULL);
+			TEST_CHECK(tickets[i] != NULL);
+		}
+		for (i = 0; i < 1000; i++) {
+			if (tickets[i] == NULL) {
+				continue;
+			}
+			if (spindle_cancel(tickets[i]) == 0) {
+				cancelled++;
+			} else {
+				started++;
+			}
+		}
+		spindle_barrier_wait(b);
+	}
+	/* the cleanup runs after a job too, as with spindle_dispatch_with_cleanup() */
+	TEST_CHECK(t.ran == started);
+	TEST_CHECK(t.cleaned == started + cancelled);
+	TEST_CHECK(started + cancelled == 20 * 1000);
+	spindle_barrier_destroy(b);
+	spindle_destroy(pool);
+}
+/* }}} */
+
+typedef struct _test_strand_t {
+	long next[TEST_KEYS];     /* the sequence number each key expects next */
+	long out_of_order;
+	long overlapped;
+	int running[TEST_KEYS];
+} test_strand_t;
+
+typedef struct _test_strand_job_t {
+	test_strand_t *state;
+	int key;
+	long seq;
+} test_strand_job_t;
+
+static void test_strand_job(void *arg) /* {{{ */
+{
+	test_strand_job_t *job = (test_strand_job_t *)arg;
+	test_strand_t *s = job->state;
+
+	if (__atomic_add_fetch(&s->running[job->key], 1, __ATOMIC_ACQ_REL) != 1) {
+		__atomic_add_fetch(&s->overlapped, 1, __ATOMIC_RELAXED);
+	}
+	if (s->next[job->key] != job->seq) {
+		__atomic_add_fetch(&s->out_of_order, 1, __ATOMIC_RELAXED);
+	}
+	s->next[job->key] = job->seq + 1;
+	__atomic_sub_fetch(&s->running[job->key], 1, __ATOMIC_ACQ_REL);
+}
+/* }}} */
+
+/* the jobs of a key run one at a time and in the order they were dispatched */
+static void test_strand_order(int scheduler) /* {{{ */
+{
+	spindle_t *pool = test_pool(scheduler, 4, 0, 0);
+	spindle_barrier_t *b = spindle_barrier_create();
+	test_strand_job_t *jobs;
+	test_strand_t s;
+	long filler = 0;
+	int i, k;
+
+	memset(&s, 0, sizeof(s));
+	jobs = malloc(sizeof(test_strand_job_t) * TEST_KEYS * TEST_KEY_JOBS);
+	spindle_barrier_start(b);
+	for (i = 0; i < TEST_KEY_JOBS; i++) {
+		for (k = 0; k < TEST_KEYS; k++) {
+			test_strand_job_t *job = &jobs[i * TEST_KEYS + k];
+
+			job->state = &s;
+			job->key = k;
+			job->seq = i;
+			TEST_CHECK(spindle_dispatch_keyed(pool, 1000 + k, b, test_strand_job, job) == 0);
+		}
+		/* unrelated jobs in between, so that the strands have to take turns with them */
+		if (i % 100 == 0) {
+			spindle_dispatch(pool, b, test_count_job, &filler);
+		}
+	}
+	spindle_barrier_end(b);
+
+	TEST_CHECK(s.out_of_order == 0);
+	TEST_CHECK(s.overlapped == 0);
+	TEST_CHECK(filler == TEST_KEY_JOBS / 100);
+	for (k = 0; k < TEST_KEYS; k++) {
+		TEST_CHECK(s.next[k] == TEST_KEY_JOBS);
+	}
+	free(jobs);
+	spindle_destroy(pool);
+}
+/* }}} */
+
+typedef struct _test_timer_t {
+	int order[TEST_TIMERS];   /* indexes of the timers in the order they fired */
+	int fired;
+	int ran[TEST_TIMERS];
+} test_timer_t;
+
+typedef struct _test_timer_arg_t {
+	test_timer_t *state;
+	int index;
+} test_timer_arg_t;
+
+static void test_timer_job(void *arg) /* {{{ */
+{
+	test_timer_arg_t *t = (test_timer_arg_t *)arg;
+	int n = __atomic_fetch_add(&t->state->fired, 1, __ATOMIC_ACQ_REL);
+
+	t->state->order[n] = t->index;
+	__atomic_add_fetch(&t->state->ran[t->index], 1, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+/* one-shot timers fire in the order of their delays (a single worker keeps the order of the queue),
+ * cancelled ones never fire; a cancelled periodic timer stops */
+static void test_timers(int scheduler) /* {{{ */
+{
+	spindle_t *pool = test_pool(scheduler, 1, 0, 0);
+	spindle_timer_t *timers[TEST_TIMERS], *every;
+	test_timer_arg_t args[TEST_TIMERS];
+	test_timer_t state;
+	long ticks = 0, stopped;
+	int i, n, cancelled[TEST_TIMERS];
+
+	memset(&state, 0, sizeof(state));
+	for (i = 0; i < TEST_TIMERS; i++) {
+		/* armed out of order, 5 msec apart, the resolution of the wheel is 1 msec */
+		n = (i * 7) % TEST_TIMERS;
+		args[n].state = &state;
+		args[n].index = n;
+		timers[n] = spindle_dispatch_after(pool, 20000 + n * 5000, test_timer_job, &args[n]);
+		TEST_CHECK(timers[n] != NULL);
+	}
+	every = spindle_dispatch_every(pool, 2000, test_count_job, &ticks);
+	TEST_CHECK(every != NULL);
+
+	for (i = 0; i < TEST_TIMERS; i++) {
+		cancelled[i] = 0;
+		if (i % 3 == 1) {
+			cancelled[i] = (spindle_timer_cancel(timers[i]) == 0);
+			TEST_CHECK(cancelled[i]);
+		} else {
+			spindle_timer_release(timers[i]);
+		}
+	}
+
+	usleep(20000 + TEST_TIMERS * 5000 + 100000);
+	TEST_CHECK(spindle_timer_cancel(every) == 0);
+	spindle_drain(pool, NULL);
+	stopped = __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+	TEST_CHECK(stopped > 10);
+	usleep(20000);
+	spindle_drain(pool, NULL);
+	TEST_CHECK(__atomic_load_n(&ticks, __ATOMIC_RELAXED) == stopped);
+
+	for (i = 0; i < TEST_TIMERS; i++) {
+		TEST_CHECK(state.ran[i] == (cancelled[i] ? 0 : 1));
+	}
+	for (i = 1; i < state.fired; i++) {
+		TEST_CHECK(state.order[i - 1] < state.order[i]);
+	}
+	spindle_destroy(pool);
+}
+/* }}} */
+
+/* a suspended pool queues the jobs without running them, drain waits for all of them after resume */
+static void test_suspend_drain(int scheduler) /* {{{ */
+{
+	spindle_t *pool = test_pool(scheduler, 4, 0, 0);
+	struct timespec ts;
+	long count = 0;
+	int round, i;
+
+	for (round = 0; round < 20; round++) {
+		test_abstime(&ts, 5000000);
+		TEST_CHECK(spindle_suspend(pool, &ts) == 0);
+		for (i = 0; i < 1000; i++) {
+			spindle_dispatch(pool, NULL, test_count_job, &count);
+		}
+		usleep(1000);
+		TEST_CHECK(__atomic_load_n(&count, __ATOMIC_RELAXED) == round * 1000);
+		spindle_resume(pool);
+		test_abstime(&ts, 5000000);
+		TEST_CHECK(spindle_drain(pool, &ts) == 0);
+		TEST_CHECK(__atomic_load_n(&count, __ATOMIC_RELAXED) == (round + 1) * 1000);
+	}
+	spindle_destroy(pool);
+}
+/* }}} */
+
+typedef struct _test_producer_t {
+	spindle_t *pool;
+	spindle_barrier_t *barrier;
+	long count;
+	volatile int done;
+} test_producer_t;
+
+static void test_short_job(void *arg) /* {{{ */
+{
+	usleep(10);
+	test_count_job(arg);
+}
+/* }}} */
+
+static void *test_produce(void *arg) /* {{{ */
+{
+	test_producer_t *p = (test_producer_t *)arg;
+	int i;
+
+	for (i = 0; i < 20000; i++) {
+		spindle_dispatch(p->pool, p->barrier, test_short_job, &p->count);
+	}
+	p->done = 1;
+	return NULL;
+}
+/* }}} */
+
+/* workers come and go while a producer keeps the pool busy: no job is lost or run twice */
+static void test_resize_under_load(int scheduler) /* {{{ */
+{
+	static const int sizes[] = {1, 8, 2, 16, 3, 1, 6};
+	test_producer_t p;
+	pthread_t thread;
+	int i;
+
+	p.pool = test_pool(scheduler, 4, 256, 0);
+	p.barrier = spindle_barrier_create();
+	p.count = 0;
+	p.done = 0;
+	spindle_barrier_start(p.barrier);
+	pthread_create(&thread, NULL, test_produce, &p);
+	for (i = 0; !p.done; i++) {
+		TEST_CHECK(spindle_resize(p.pool, sizes[i % (sizeof(sizes) / sizeof(sizes[0]))]) == 0);
+		usleep(2000);
+	}
+	pthread_join(thread, NULL);
+	spindle_barrier_end(p.barrier);
+	TEST_CHECK(p.count == 20000);
+	spindle_destroy(p.pool);
+}
+/* }}} */
+
+typedef struct _test_full_t {
+	spindle_t *pool;
+	long leaves;
+	long timedout;
+	long rejected;
+} test_full_t;
+
+/* fans out far more jobs than the queue holds and waits for them, from a worker */
+static void test_fan_job(void *arg) /* {{{ */
+{
+	test_full_t *f = (test_full_t *)arg;
+	spindle_barrier_t *b = spindle_barrier_create();
+	spindle_batch_job_t batch[50];
+	int i;
+
+	spindle_barrier_start(b);
+	for (i = 0; i < 100; i++) {
+		spindle_dispatch(f->pool, b, test_count_job, &f->leaves);
+	}
+	for (i = 0; i < 50; i++) {
+		batch[i].func = test_count_job;
+		batch[i].arg = &f->leaves;
+		batch[i].cleanup_func = NULL;
+		batch[i].cleanup_arg = NULL;
+	}
+	spindle_dispatch_batch(f->pool, b, batch, 50);
+	/* nested fork-join: with every worker in here, nobody else would run the jobs */
+	spindle_barrier_wait_help(f->pool, b);
+	spindle_barrier_destroy(b);
+}
+/* }}} */
+
+static void test_sleep_job(void *arg) /* {{{ */
+{
+	usleep(20000);
+}
+/* }}} */
+
+/* bounded dispatches from a worker fail like anywhere else instead of running the job in place */
+static void test_bounded_job(void *arg) /* {{{ */
+{
+	test_full_t *f = (test_full_t *)arg;
+	struct timespec ts;
+	int i, err;
+
+	for (i = 0; i < 20; i++) {
+		test_abstime(&ts, 2000);
+		err = spindle_dispatch_timed(f->pool, NULL, test_sleep_job, NULL, &ts);
+		TEST_CHECK(err == 0 || err == ETIMEDOUT);
+		if (err == ETIMEDOUT) {
+			__atomic_add_fetch(&f->timedout, 1, __ATOMIC_RELAXED);
+		}
+		err = spindle_try_dispatch(f->pool, NULL, test_sleep_job, NULL);
+		TEST_CHECK(err == 0 || err == EAGAIN);
+		if (err == EAGAIN) {
+			__atomic_add_fetch(&f->rejected, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+/* }}} */
+
+/* workers dispatching to their own full queue neither deadlock nor lose jobs, on fibers too */
+static void test_full_from_worker(int scheduler, int fibers) /* {{{ */
+{
+	spindle_barrier_t *b;
+	test_full_t f = {NULL, 0, 0, 0};
+	int i;
+
+	f.pool = test_pool(scheduler, 2, 8, fibers);
+	b = spindle_barrier_create();
+	spindle_barrier_start(b);
+	for (i = 0; i < 20; i++) {
+		spindle_dispatch(f.pool, b, test_fan_job, &f);
+	}
+	spindle_barrier_end(b);
+	TEST_CHECK(f.leaves == 20 * 150);
+
+	b = spindle_barrier_create();
+	spindle_barrier_start(b);
+	spindle_dispatch(f.pool, b, test_bounded_job, &f);
+	spindle_barrier_end(b);
+	if (scheduler == SPINDLE_SCHED_SHARED) {
+		/* the deques of the stealing scheduler take these jobs, so only the shared queue fills up */
+		TEST_CHECK(f.timedout > 0);
+		TEST_CHECK(f.rejected > 0);
+	}
+	spindle_destroy(f.pool);
+}
+/* }}} */
+
+int main(int argc, char **argv) /* {{{ */
+{
+	static const char *names[] = {"shared", "stealing"};
+	static const int schedulers[] = {SPINDLE_SCHED_SHARED, SPINDLE_SCHED_STEALING};
+	int s;
+
+	alarm(TEST_TIMEOUT_SEC);
+
+	for (s = 0; s < 2; s++) {
+		test_scheduler = names[s];
+		test_barrier_reuse(schedulers[s]);
+		test_cancel_race(schedulers[s]);
+		test_strand_order(schedulers[s]);
+		test_timers(schedulers[s]);
+		test_suspend_drain(schedulers[s]);
+		test_resize_under_load(schedulers[s]);
+		test_full_from_worker(schedulers[s], 0);
+		test_full_from_worker(schedulers[s], 1);
+		printf("%s: %s\n", names[s], test_failed ? "FAILED" : "ok");
+	}
+	return test_failed ? 1 : 0;
+}
+/* }}} */